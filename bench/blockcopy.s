@@ -0,0 +1,42 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; blockcopy.s - memcopy.s with the block instructions. Fills 256 bytes at $1000 with MEMSET
+; and a loop, then copies them to $2000 with MEMCPY as many times as memcopy.s does.
+
+BLOCK	EQU $0f10	; Parameter block: destination, source, length
+COUNT	EQU $0f00
+
+	LDA #$10	; Destination $1000, length 256.
+	STA BLOCK
+	LDA #1
+	STA BLOCK + 4
+	LDA #0
+	MEMSET BLOCK	; Clear $1000-$10ff, then store 255, 254 ... 1 after the 0.
+	LDX #0
+fill:
+	TXA
+	STA $1000
+	LDA fill + 3	; Low byte of the STA operand, which comes second.
+	INC
+	STA fill + 3
+	DEX
+	JNE fill
+	LDA #$20	; Copy to $2000 from $1000.
+	STA BLOCK
+	LDA #$10
+	STA BLOCK + 2
+	LDA #40		; Outer counter.
+	STA COUNT
+outer:
+	LDY #255	; Inner counter, one copy each.
+copy:
+	MEMCPY BLOCK
+	DEY
+	JNE copy
+	LDA COUNT
+	DEC
+	STA COUNT
+	JNE outer
+	LDA $2080
+	OUT			; Prints 128.
+	HALT
@@ -0,0 +1,25 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; calls.s - JSR and RTS benchmark. Two levels of subroutine calls in a loop, about 20 million instructions.
+
+	LDA #20		; Outer counter.
+	STA $0f00	; $102
+	LDY #255	; $105 Middle counter.
+	LDX #255	; $107 Inner counter.
+	LDA #0		; $109
+	JSR $125	; $10b Call add3, which calls add1 twice.
+	JSR $12b	; $10e Call add1.
+	DEX			; $111
+	JNE $109	; $112
+	DEY			; $115
+	JNE $107	; $116
+	LDA $0f00	; $119
+	DEC			; $11c
+	STA $0f00	; $11d
+	JNE $105	; $120
+	OUT			; $123 Prints 0.
+	HALT		; $124
+	JSR $12b	; $125 add3: add1 twice, then falls into add1 for the third.
+	JSR $12b	; $128
+	INC			; $12b add1
+	RTS			; $12c
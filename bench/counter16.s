@@ -0,0 +1,27 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; counter16.s - A 16-bit counter in memory, stepped in threes from 0 to 60000 with the wide
+; instructions, 40 times over.
+
+COUNT	EQU $f0	; Outer counter, in zero page. <COUNT uses the zero page forms.
+TOTAL	EQU $1000	; The counter, a little-endian word
+
+	LDA #40
+	STA <COUNT
+outer:
+	LDAW #0
+	STAW TOTAL
+inner:
+	LDAW TOTAL
+	CLC
+	ADDW #3
+	STAW TOTAL
+	CMPW #60000
+	JNE inner
+	LDA <COUNT
+	DEC
+	STA <COUNT
+	JNE outer
+	LDA TOTAL
+	OUT			; Prints 96, the low byte of 60000.
+	HALT
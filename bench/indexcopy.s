@@ -0,0 +1,33 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; indexcopy.s - memcopy.s with indexed addressing. Fills 256 bytes at $1000, then copies them to
+; $2000 with an LDA abs,X / STA abs,X loop as many times as memcopy.s does.
+
+COUNT	EQU $f0	; Outer counter, in zero page. <COUNT uses the zero page forms.
+
+	LDX #0		; Fill $1000-$10ff with 0, 255, 254 ... 1.
+fill:
+	TXA
+	STA $1000,X
+	DEX
+	JNE fill
+	LDA #40
+	STA <COUNT
+outer:
+	LDY #255	; Middle counter, one copy each.
+middle:
+	LDX #0		; 256 bytes per copy.
+copy:
+	LDA $1000,X
+	STA $2000,X
+	INX
+	JNE copy
+	DEY
+	JNE middle
+	LDA <COUNT
+	DEC
+	STA <COUNT
+	JNE outer
+	LDA $2080
+	OUT			; Prints 128.
+	HALT
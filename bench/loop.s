@@ -0,0 +1,15 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; loop.s - Dispatch benchmark. Three nested count down loops, about 26 million instructions.
+
+	LDA #200	; Outer counter.
+	LDY #255	; $102 Middle counter.
+	LDX #255	; $104 Inner counter.
+	DEX			; $106 Inner loop.
+	JNE $106	;
+	DEY			; $10A
+	JNE $104	;
+	DEC			; $10E
+	JNE $102	;
+	OUT			; Prints 0.
+	HALT
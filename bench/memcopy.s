@@ -0,0 +1,35 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; memcopy.s - Memory copy benchmark. Fills 256 bytes at $1000, then copies them to $2000 over and
+; over, about 21 million instructions. It doesn't use indexed addressing (see indexcopy.s): the loops
+; step through memory by rewriting the low byte of their own LDA and STA operands.
+
+	LDX #0		; Fill $1000-$10ff with 0, 255, 254 ... 1.
+	TXA			; $102
+	STA $1000	; $103
+	LDA $0105	; $106 Low byte of the STA operand, which comes second.
+	INC			; $109
+	STA $0105	; $10a
+	DEX			; $10d
+	JNE $102	; $10e
+	LDA #40		; $111 Outer counter.
+	STA $0f00	; $113
+	LDY #255	; $116 Middle counter, one copy each.
+	LDX #0		; $118 256 bytes per copy.
+	LDA $1000	; $11a Source.
+	STA $2000	; $11d Destination.
+	LDA $011c	; $120 Low byte of the source address.
+	INC			; $123
+	STA $011c	; $124
+	STA $011f	; $127 Destination low byte follows it.
+	DEX			; $12a
+	JNE $11a	; $12b
+	DEY			; $12e
+	JNE $118	; $12f
+	LDA $0f00	; $132
+	DEC			; $135
+	STA $0f00	; $136
+	JNE $116	; $139
+	LDA $2080	; $13c
+	OUT			; $13f Prints 128.
+	HALT		; $140
@@ -0,0 +1,29 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; muldiv.s - Multiply and divide benchmark. A little arithmetic on two variables in a loop, about
+; 23 million instructions.
+
+	LDA #7		; Divisor.
+	STA $0f01	; $102
+	LDA #40		; $105 Outer counter.
+	STA $0f00	; $107
+	LDY #255	; $10a Middle counter.
+	LDX #255	; $10c Inner counter.
+	TXA			; $10e
+	MUL #3		; $10f
+	DIV #2		; $111
+	ADD #11		; $113
+	MUL $0f01	; $115
+	DIV $0f01	; $118
+	STA $0f02	; $11b
+	DEX			; $11e
+	JNE $10e	; $11f
+	DEY			; $122
+	JNE $10c	; $123
+	LDA $0f00	; $126
+	DEC			; $129
+	STA $0f00	; $12a
+	JNE $10a	; $12d
+	LDA $0f02	; $130
+	OUT			; $133 Prints 12.
+	HALT		; $134
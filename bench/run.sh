@@ -0,0 +1,91 @@
+#!/bin/sh
+# run.sh - The benchmark suite, run by make bench.
+#
+# Every kernel is run once to warm up, then REPS more times with each VM, and the median run is
+# reported, along with how far the fastest and slowest runs were from it. The assembler is timed
+# the same way on a large generated source file. Each kernel prints a known value, which is
+# checked, so a VM that got faster by getting it wrong doesn't go unnoticed.
+#
+#	REPS=n		Timed runs per measurement (5)
+#	VMS=list	VMs to compare, separated by |
+#	LINES=n		Lines in the generated assembler source (20000)
+
+REPS=${REPS:-5}
+VMS=${VMS:-"./nanovm|./nanovm --no-fuse|./nanovm --jit|./nanovm-switch"}
+LINES=${LINES:-20000}
+
+# Kernels and what they print
+KERNELS="loop:0 memcopy:128 indexcopy:128 blockcopy:128 counter16:96 muldiv:12 calls:0 stack:2"
+
+# Median, lowest and highest of the numbers on stdin, one per line
+stats() {
+	sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)], v[1], v[NR] }'
+}
+
+now() {
+	date +%s%N
+}
+
+printf "%-10s %-18s %10s %14s %9s %15s\n" Kernel VM Cycles "Cycles/s" "ns/instr" "Spread"
+for kernel in $KERNELS; do
+	name=${kernel%%:*}
+	expect=${kernel#*:}
+	./nanoasm bench/$name.s bench/$name.bin > /dev/null || exit 1
+	IFS='|'
+	for vm in $VMS; do
+		unset IFS
+		$vm --no-dump bench/$name.bin < /dev/null > /dev/null
+		rates=""
+		for i in $(seq $REPS); do
+			out=$($vm --no-dump bench/$name.bin < /dev/null)
+			result=$(echo "$out" | sed -n 2p)
+			cycles=$(echo "$out" | sed -n 's/^Number of cycles: \([0-9]*\).*/\1/p')
+			rates="$rates$(echo "$out" | sed -n 's/^\([0-9]*\) cycles per second.*/\1/p')
+"
+		done
+		set -- $(printf "%s" "$rates" | stats)
+		awk -v k=$name -v vm="$vm" -v c=$cycles -v m=$1 -v lo=$2 -v hi=$3 -v ok="$([ "$result" = "$expect" ] || echo " WRONG OUTPUT")" 'BEGIN {
+			printf "%-10s %-18s %10d %14.0f %9.2f   -%4.1f%% +%4.1f%%%s\n", k, vm, c, m, 1e9 / m,
+				(m - lo) * 100 / m, (hi - m) * 100 / m, ok }'
+		IFS='|'
+	done
+	unset IFS
+done
+
+# A large source file using every instruction the assembler knows, and every kind of operand
+awk -v lines=$LINES 'BEGIN {
+	split("LDA #%d|LDA $%04X|STA $%04X|ADD #$%02X|SUB %%%s|MUL #%d|DIV $%04X|CMP #%d|JMP $%04X|JEQ $%04X|JNE $%04X|JSR $%04X|RTS|PUSHA|POPA|SHL|SHR|INC|DEC|NOP|LDX #%d|LDY $%04X|STX $%04X|STY $%04X|CPX #%d|CPY $%04X|TAX|TAY|TXA|TYA|INX|INY|DEX|DEY|NEG|DUP|SWAP|AND #%d|OR $%04X|XOR #%d|NOT|CLC|SEC|OUT|MEMCPY $%04X|MEMSET $%04X|MEMCMP $%04X|LDA $%04X,X|STA $%04X,Y|ADD ($%02X),Y|CMP <$%02X|LDAW #%d|STAW $%04X|ADDW $%04X|SUBW #%d|CMPW $%04X|INCW|DECW", forms, "|")
+	print "\tORG $100\t; Generated by bench/run.sh for timing the assembler"
+	for(i=1; i<lines; i++) {
+		f = forms[(i * 7) % 58 + 1]
+		n = (i * 37) % 256
+		if( f ~ /%%%s/ ) {
+			bits = ""
+			for(b=128; b>=1; b/=2)
+				bits = bits (int(n / b) % 2)
+			line = sprintf(f, bits)
+		} else if( f ~ /\$%04X/ )
+			line = sprintf(f, 4096 + (i * 13) % 4096)
+		else
+			line = sprintf(f, n)
+		if( i % 5 == 0 )
+			line = line "\t\t; Comment " i
+		print "\t" line
+		if( i % 50 == 0 )
+			print "; Block " i / 50
+	}
+	print "\tHALT"
+}' > bench/big.s
+lines=$(wc -l < bench/big.s)
+./nanoasm bench/big.s bench/big.bin > /dev/null || exit 1
+times=""
+for i in $(seq $REPS); do
+	start=$(now)
+	./nanoasm bench/big.s bench/big.bin > /dev/null
+	times="$times$(( $(now) - start ))
+"
+done
+set -- $(printf "%s" "$times" | stats)
+echo
+awk -v n=$lines -v m=$1 -v lo=$2 -v hi=$3 'BEGIN {
+	printf "nanoasm: %d lines in %.2f ms, %.0f lines/s (fastest %.2f ms, slowest %.2f ms)\n", n, m / 1e6, n * 1e9 / m, lo / 1e6, hi / 1e6 }'
@@ -0,0 +1,29 @@
+	ORG $100	; ORG directive must be the first line of code in an assembly file
+
+; stack.s - Stack benchmark. Pushes, pops, duplicates and swaps in a loop, about 25 million instructions.
+
+	LDA #32		; Outer counter.
+	STA $0f00	; $102
+	LDY #255	; $105 Middle counter.
+	LDX #255	; $107 Inner counter.
+	TXA			; $109
+	PUSHA		; $10a x
+	DUP			; $10b x x
+	INC			; $10c
+	PUSHA		; $10d x x x+1
+	SWAP		; $10e x x+1 x
+	POPA		; $10f x x+1
+	POPA		; $110 x
+	STA $0f01	; $111
+	POPA		; $114
+	DEX			; $115
+	JNE $109	; $116
+	DEY			; $119
+	JNE $107	; $11a
+	LDA $0f00	; $11d
+	DEC			; $120
+	STA $0f00	; $121
+	JNE $105	; $124
+	LDA $0f01	; $127
+	OUT			; $12a Prints 2.
+	HALT		; $12b
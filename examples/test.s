@@ -9,7 +9,7 @@
 	LDA $17F
 	OUT
 	ADD #1
-	OUT1
+	OUT
 	ADD $17F
 	OUT
 	SUB #1
@@ -0,0 +1,239 @@
+/* batch.c - Run many program images at once (nanovm --batch).
+ *
+ * The jobs are shared out between the workers' queues up front. A worker runs jobs from the
+ * back of its own queue, and once that is empty it steals from the front of the others', so
+ * a worker that drew the long-running programs doesn't hold the rest up. No jobs are added
+ * while the batch runs, so a worker finding every queue empty is done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "nanovm.h"
+#include "batch.h"
+
+struct job {
+	char *name;									// Image file name
+	unsigned char *image;						// Mapped once and shared by every job that runs it
+	size_t size;
+	char *input;								// What IN reads
+	int line;									// Which input vector, counting from 1, or 0
+	char *output;								// Everything OUT wrote
+	size_t output_size;
+	unsigned long cycles;
+	int status;									// nanovm_load() result, or NO_VM
+	int stopped;								// nanovm_run_limited() result
+	char *fault;								// What the fault was, if it stopped on one
+	size_t fault_size;
+};
+
+#define NO_VM 1									// Its worker couldn't create a VM to run it on
+
+struct queue {
+	pthread_mutex_t lock;
+	int *jobs;
+	int front, back;							// Jobs still to run are jobs[front] to jobs[back - 1]
+};
+
+static struct job *jobs;
+static struct queue *queues;
+static int num_queues;
+static int vm_options;
+static struct nanovm_limits *job_limits;
+static unsigned char *snapshot;					// Every job starts from here, if set
+static size_t snapshot_size;
+static char no_input[] = "";
+
+// Take a job from the back of our own queue, or steal one from the front of another
+static int take_job(int self) {
+	struct queue *q = &queues[self];
+	int job = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if( q->front < q->back )
+		job = q->jobs[--q->back];
+	pthread_mutex_unlock(&q->lock);
+
+	for(int i=1; job < 0 && i<num_queues; i++) {
+		q = &queues[(self + i) % num_queues];
+		pthread_mutex_lock(&q->lock);
+		if( q->front < q->back )
+			job = q->jobs[q->front++];
+		pthread_mutex_unlock(&q->lock);
+	}
+	return job;
+}
+
+// Run a job on the worker's VM. Loading the next job resets it, whatever state the last one left it in.
+static void run_job(NanoVM *vm, struct job *job) {
+	job->status = nanovm_load_shared(vm, job->image, job->size);
+	if( job->status == NANOVM_OK && snapshot != NULL )
+		job->status = nanovm_restore(vm, snapshot, snapshot_size);
+	if( job->status == NANOVM_OK ) {
+		nanovm_set_input(vm, job->input, strlen(job->input));
+		vm->out = open_memstream(&job->output, &job->output_size);
+		job->stopped = nanovm_run_limited(vm, job_limits);
+		fclose(vm->out);
+		job->cycles = vm->cycles;
+		if( job->stopped == NANOVM_FAULT ) {
+			// Goes after the job's output
+			FILE *fp = open_memstream(&job->fault, &job->fault_size);
+			nanovm_print_fault(vm, fp);
+			fclose(fp);
+		}
+	}
+}
+
+static void *worker(void *arg) {
+	int self = (long) arg;
+	int job;
+	NanoVM *vm = nanovm_create(vm_options);
+
+	while( (job = take_job(self)) >= 0 ) {
+		if( vm == NULL )
+			jobs[job].status = NO_VM;
+		else
+			run_job(vm, &jobs[job]);
+	}
+	if( vm != NULL )
+		nanovm_destroy(vm);
+	return NULL;
+}
+
+int run_batch(char **images, int num_images, char *inputs, int options, int threads, char *restore,
+		struct nanovm_limits *limits) {
+	struct timeval start, stop;
+	int num_jobs = 0;
+	size_t size;
+
+	if( restore != NULL )
+		snapshot = read_image(restore, &snapshot_size);
+
+	if( inputs != NULL ) {
+		// One image, one job per line of the inputs file. An empty line is a job with no input.
+		if( num_images != 1 ) {
+			printf("Error. --inputs needs exactly one program image.\n");
+			return 1;
+		}
+		size_t image_size;
+		unsigned char *image = read_image(images[0], &image_size);
+		unsigned char *file = read_image(inputs, &size);
+		char *text = malloc(size + 1);
+		memcpy(text, file, size);
+		text[size] = 0;
+		free_image(file, size);
+		jobs = calloc(size + 1, sizeof(struct job));
+		for(char *line = text; line < text + size; ) {
+			char *end = strchr(line, '\n');
+			if( end == NULL )
+				end = text + size;
+			*end = 0;
+			struct job *job = &jobs[num_jobs++];
+			job->name = images[0];
+			job->image = image;
+			job->size = image_size;
+			job->input = line;
+			job->line = num_jobs;
+			line = end + 1;
+		}
+	} else {
+		jobs = calloc(num_images, sizeof(struct job));
+		for(int i=0; i<num_images; i++) {
+			struct job *job = &jobs[num_jobs++];
+			job->name = images[i];
+			job->image = read_image(images[i], &job->size);
+			job->input = no_input;
+		}
+	}
+	if( num_jobs == 0 ) {
+		printf("Nothing to run.\n");
+		return 1;
+	}
+
+	if( threads <= 0 )
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if( threads > num_jobs )
+		threads = num_jobs;
+	if( threads < 1 )
+		threads = 1;
+
+	// Each worker starts with an equal share of the jobs, in order
+	vm_options = options;
+	job_limits = limits;
+	num_queues = threads;
+	queues = calloc(threads, sizeof(struct queue));
+	for(int i=0; i<threads; i++) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+		queues[i].jobs = malloc(num_jobs * sizeof(int));
+	}
+	for(int i=0; i<num_jobs; i++) {
+		struct queue *q = &queues[(long) i * threads / num_jobs];
+		q->jobs[q->back++] = i;
+	}
+
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	gettimeofday(&start, NULL);
+	int started = 0;
+	for(long i=0; i<threads; i++)
+		if( pthread_create(&workers[started], NULL, worker, (void *) i) == 0 )
+			started++;
+	// The threads that did start steal the jobs of any that didn't
+	if( started == 0 )
+		worker((void *) 0);
+	for(int i=0; i<started; i++)
+		pthread_join(workers[i], NULL);
+	threads = started > 0 ? started : 1;
+	gettimeofday(&stop, NULL);
+	unsigned long period = (stop.tv_sec - start.tv_sec) * 1000000 + stop.tv_usec - start.tv_usec;
+
+	// Output in job order
+	unsigned long total_cycles = 0;
+	int failed = 0;
+	for(int i=0; i<num_jobs; i++) {
+		struct job *job = &jobs[i];
+		printf("--- %s", job->name);
+		if( job->line > 0 )
+			printf(" input %d", job->line);
+		if( job->status == NANOVM_BAD_MAGIC ) {
+			printf(": Not a nanovm program image file. Bad magic number.\n");
+			failed = 1;
+		} else if( job->status == NANOVM_TOO_LARGE ) {
+			printf(": Program too large. Memory is %d bytes in size.\n", MAX_MEM);
+			failed = 1;
+		} else if( job->status == NANOVM_BAD_SNAPSHOT ) {
+			printf(": Not a nanovm snapshot file.\n");
+			failed = 1;
+		} else if( job->status == NO_VM ) {
+			printf(": Not enough memory for a VM.\n");
+			failed = 1;
+		} else {
+			printf(": %lu cycles", job->cycles);
+			if( job->stopped == NANOVM_CYCLE_LIMIT )
+				printf(", stopped at the cycle limit");
+			else if( job->stopped == NANOVM_TIME_LIMIT )
+				printf(", stopped at the time limit");
+			else if( job->stopped == NANOVM_OUTPUT_LIMIT )
+				printf(", stopped at the output limit");
+			else if( job->stopped == NANOVM_FAULT )
+				printf(", stopped on an error");
+			if( job->stopped != NANOVM_HALTED )
+				failed = 1;
+			printf("\n");
+			fwrite(job->output, 1, job->output_size, stdout);
+			free(job->output);
+			if( job->fault != NULL ) {
+				fwrite(job->fault, 1, job->fault_size, stdout);
+				free(job->fault);
+			}
+			total_cycles += job->cycles;
+		}
+	}
+
+	printf("Ran %d jobs on %d threads in %lu microseconds.\n", num_jobs, threads, period);
+	if( period > 0 )
+		printf("%.0f jobs per second, %.0f cycles per second (%s dispatch).\n", num_jobs * 1000000.0 / period,
+			total_cycles * 1000000.0 / period, nanovm_dispatch_name());
+	return failed;
+}
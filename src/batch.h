@@ -0,0 +1,16 @@
+#ifndef batch
+#define batch
+
+/* batch.h - Run many program images at once (nanovm --batch).
+ *
+ * Every image, or every line of an input file for a single image, is a job. Jobs run on
+ * a pool of threads, each with its own NanoVM, and their output is printed in job order
+ * once they have all finished.
+ */
+
+unsigned char *read_image(char *fname, size_t *size);		// In nanovm.c
+void free_image(unsigned char *image, size_t size);
+int run_batch(char **images, int num_images, char *inputs, int options, int threads, char *restore,
+	struct nanovm_limits *limits);
+
+#endif
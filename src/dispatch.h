@@ -0,0 +1,799 @@
+/* dispatch.h - The dispatch loop. vm.c includes it three times, to compile RUN_LOOP as the
+ * normal loop and as copies with the COUNT() and COUNT_TAKEN() hooks filled in for --profile
+ * and for tracing, so the normal loop pays nothing for either. PROFILING or TRACING is defined
+ * for those copies, which are the only ones with the locals their hooks use.
+ */
+static int RUN_LOOP(NanoVM *vm, unsigned long cycles) {
+	unsigned char input = 0;
+	int value;
+	unsigned short address;
+	unsigned char source;
+#ifndef THREADED_DISPATCH
+	unsigned char op;								// What the switch dispatches on
+#endif
+	struct decoded *d, *d2, *d3, *d4;
+	unsigned char n;
+	unsigned char buf[2];
+	unsigned char cmp_value;
+	unsigned char cmp_x_value;
+	unsigned char cmp_y_value;
+	unsigned char a,b;
+	struct jit_regs regs;
+	struct block blk;
+	unsigned short word;
+
+	if( vm->halted )
+		return NANOVM_HALTED;
+	vm->fault = NANOVM_NO_FAULT;
+
+	// The CPU registers are locals so the compiler can keep them in host registers
+	// while the dispatch loop runs.
+	unsigned short pc = vm->pc;						// Program counter
+	unsigned short acc = vm->acc;					// Accumulator
+	unsigned short x = vm->x;						// X register
+	unsigned short y = vm->y;						// Y register
+	unsigned char z_flag = vm->z_flag;				// Zero flag
+	unsigned char carry_flag = vm->carry_flag;		// Carry flag
+	unsigned long total_cycles = vm->cycles;
+	unsigned long cycle_limit = total_cycles + cycles < total_cycles ? ~0UL : total_cycles + cycles;
+	unsigned char *memory = vm->memory;
+	struct decoded *cache = vm->decoded;
+#ifdef PROFILING
+	unsigned long *executed = vm->profile->executed;
+#endif
+#ifdef TRACING
+	struct nanovm_trace *trace = vm->trace;
+	struct nanovm_trace_record *trace_records = trace->records;
+	unsigned long trace_mask = trace->size - 1;
+	unsigned long trace_head = trace->head;
+#endif
+	int status = NANOVM_OUT_OF_CYCLES;
+
+	regs.memory = memory;
+	// Leaves a whole block's worth of cycles for the interpreter, see OP_JIT_ENTER
+	regs.cycle_limit = cycle_limit - JIT_MAX_INSTRUCTIONS;
+
+#ifdef THREADED_DISPATCH
+	// One label per decoded opcode. Anything not listed here is an illegal instruction.
+	static const void *dispatch_table[256] = {
+		[0 ... 255] = &&illegal_instruction, [OP_DECODE] = &&L_OP_DECODE,
+		[FUSED_LDA_SUB_STA_JNE] = &&L_FUSED_LDA_SUB_STA_JNE, [FUSED_LDA_ADD_STA] = &&L_FUSED_LDA_ADD_STA,
+		[FUSED_LDA_STA] = &&L_FUSED_LDA_STA, [FUSED_LDA_IMM_STA] = &&L_FUSED_LDA_IMM_STA,
+		[FUSED_CMP_JEQ] = &&L_FUSED_CMP_JEQ, [FUSED_CMP_JNE] = &&L_FUSED_CMP_JNE,
+		[FUSED_SUB_JNE] = &&L_FUSED_SUB_JNE, [FUSED_DEX_JNE] = &&L_FUSED_DEX_JNE,
+		[FUSED_DEY_JNE] = &&L_FUSED_DEY_JNE, [OP_FUSE_CANDIDATE] = &&L_OP_FUSE_CANDIDATE,
+		[OP_JIT_COUNT] = &&L_OP_JIT_COUNT, [OP_JIT_ENTER] = &&L_OP_JIT_ENTER, [OP_BREAK] = &&L_OP_BREAK,
+		[OP_WRAP] = &&L_OP_WRAP,
+		[DECODED(LDA_IMM)] = &&L_LDA_IMM, [DECODED(LDA_ABS)] = &&L_LDA_ABS, [DECODED(STA)] = &&L_STA, [DECODED(ADD_IMM)] = &&L_ADD_IMM,
+		[DECODED(ADD_ABS)] = &&L_ADD_ABS, [DECODED(SUB_IMM)] = &&L_SUB_IMM, [DECODED(SUB_ABS)] = &&L_SUB_ABS,
+		[DECODED(MUL_IMM)] = &&L_MUL_IMM, [DECODED(MUL_ABS)] = &&L_MUL_ABS, [DECODED(DIV_IMM)] = &&L_DIV_IMM,
+		[DECODED(DIV_ABS)] = &&L_DIV_ABS, [DECODED(JMP)] = &&L_JMP, [DECODED(JEQ)] = &&L_JEQ, [DECODED(JNE)] = &&L_JNE, [DECODED(HALT)] = &&L_HALT,
+		[DECODED(IN)] = &&L_IN, [DECODED(OUT)] = &&L_OUT, [DECODED(JSR)] = &&L_JSR, [DECODED(RTS)] = &&L_RTS, [DECODED(CMP_IMM)] = &&L_CMP_IMM,
+		[DECODED(CMP_ABS)] = &&L_CMP_ABS, [DECODED(JMP_IND)] = &&L_JMP_IND, [DECODED(PUSHA)] = &&L_PUSHA, [DECODED(POPA)] = &&L_POPA,
+		[DECODED(SHL)] = &&L_SHL, [DECODED(SHR)] = &&L_SHR, [DECODED(INC)] = &&L_INC, [DECODED(DEC)] = &&L_DEC, [DECODED(NOP)] = &&L_NOP,
+		[DECODED(LDX_IMM)] = &&L_LDX_IMM, [DECODED(LDX_ABS)] = &&L_LDX_ABS, [DECODED(LDY_IMM)] = &&L_LDY_IMM,
+		[DECODED(LDY_ABS)] = &&L_LDY_ABS, [DECODED(STX)] = &&L_STX, [DECODED(STY)] = &&L_STY, [DECODED(CPX_IMM)] = &&L_CPX_IMM,
+		[DECODED(CPX_ABS)] = &&L_CPX_ABS, [DECODED(CPY_IMM)] = &&L_CPY_IMM, [DECODED(CPY_ABS)] = &&L_CPY_ABS, [DECODED(TAX)] = &&L_TAX,
+		[DECODED(TAY)] = &&L_TAY, [DECODED(TXA)] = &&L_TXA, [DECODED(TYA)] = &&L_TYA, [DECODED(INX)] = &&L_INX, [DECODED(INY)] = &&L_INY,
+		[DECODED(DEX)] = &&L_DEX, [DECODED(DEY)] = &&L_DEY, [DECODED(NEG)] = &&L_NEG, [DECODED(DUP)] = &&L_DUP, [DECODED(SWAP)] = &&L_SWAP,
+		[DECODED(AND_IMM)] = &&L_AND_IMM, [DECODED(AND_ABS)] = &&L_AND_ABS, [DECODED(OR_IMM)] = &&L_OR_IMM, [DECODED(OR_ABS)] = &&L_OR_ABS,
+		[DECODED(XOR_IMM)] = &&L_XOR_IMM, [DECODED(XOR_ABS)] = &&L_XOR_ABS, [DECODED(NOT)] = &&L_NOT, [DECODED(CLC)] = &&L_CLC,
+		[DECODED(SEC)] = &&L_SEC, [DECODED(JCS)] = &&L_JCS, [DECODED(JCC)] = &&L_JCC,
+		[DECODED(MEMCPY)] = &&L_MEMCPY, [DECODED(MEMSET)] = &&L_MEMSET, [DECODED(MEMCMP)] = &&L_MEMCMP,
+		[DECODED(LDA_ZP)] = &&L_LDA_ZP, [DECODED(STA_ZP)] = &&L_STA_ZP, [DECODED(ADD_ZP)] = &&L_ADD_ZP,
+		[DECODED(SUB_ZP)] = &&L_SUB_ZP, [DECODED(CMP_ZP)] = &&L_CMP_ZP, [DECODED(AND_ZP)] = &&L_AND_ZP,
+		[DECODED(OR_ZP)] = &&L_OR_ZP, [DECODED(XOR_ZP)] = &&L_XOR_ZP, [DECODED(LDX_ZP)] = &&L_LDX_ZP,
+		[DECODED(LDY_ZP)] = &&L_LDY_ZP, [DECODED(STX_ZP)] = &&L_STX_ZP, [DECODED(STY_ZP)] = &&L_STY_ZP,
+		[DECODED(LDA_ABS_X)] = &&L_LDA_ABS_X, [DECODED(STA_ABS_X)] = &&L_STA_ABS_X, [DECODED(ADD_ABS_X)] = &&L_ADD_ABS_X,
+		[DECODED(SUB_ABS_X)] = &&L_SUB_ABS_X, [DECODED(CMP_ABS_X)] = &&L_CMP_ABS_X, [DECODED(AND_ABS_X)] = &&L_AND_ABS_X,
+		[DECODED(OR_ABS_X)] = &&L_OR_ABS_X, [DECODED(XOR_ABS_X)] = &&L_XOR_ABS_X, [DECODED(LDA_ABS_Y)] = &&L_LDA_ABS_Y,
+		[DECODED(STA_ABS_Y)] = &&L_STA_ABS_Y, [DECODED(ADD_ABS_Y)] = &&L_ADD_ABS_Y, [DECODED(SUB_ABS_Y)] = &&L_SUB_ABS_Y,
+		[DECODED(CMP_ABS_Y)] = &&L_CMP_ABS_Y, [DECODED(AND_ABS_Y)] = &&L_AND_ABS_Y, [DECODED(OR_ABS_Y)] = &&L_OR_ABS_Y,
+		[DECODED(XOR_ABS_Y)] = &&L_XOR_ABS_Y, [DECODED(LDA_IND_Y)] = &&L_LDA_IND_Y, [DECODED(STA_IND_Y)] = &&L_STA_IND_Y,
+		[DECODED(ADD_IND_Y)] = &&L_ADD_IND_Y, [DECODED(SUB_IND_Y)] = &&L_SUB_IND_Y, [DECODED(CMP_IND_Y)] = &&L_CMP_IND_Y,
+		[DECODED(AND_IND_Y)] = &&L_AND_IND_Y, [DECODED(OR_IND_Y)] = &&L_OR_IND_Y, [DECODED(XOR_IND_Y)] = &&L_XOR_IND_Y,
+		[DECODED(LDAW_IMM)] = &&L_LDAW_IMM, [DECODED(LDAW_ABS)] = &&L_LDAW_ABS, [DECODED(STAW)] = &&L_STAW,
+		[DECODED(ADDW_IMM)] = &&L_ADDW_IMM, [DECODED(ADDW_ABS)] = &&L_ADDW_ABS, [DECODED(SUBW_IMM)] = &&L_SUBW_IMM,
+		[DECODED(SUBW_ABS)] = &&L_SUBW_ABS, [DECODED(CMPW_IMM)] = &&L_CMPW_IMM, [DECODED(CMPW_ABS)] = &&L_CMPW_ABS,
+		[DECODED(INCW)] = &&L_INCW, [DECODED(DECW)] = &&L_DECW
+	};
+#endif
+	
+	// Execute loaded program
+	for(;;) {
+		// Dispatch the next pre-decoded instruction. pc already points past it.
+		DISPATCH() {
+		HANDLER(OP_DECODE):
+			decode(vm, pc);
+			RETRY;
+		HANDLER(OP_FUSE_CANDIDATE):
+			// Profiled superinstruction site. Run the first instruction on its own until it is hot.
+			if( ++d->hits == FUSE_THRESHOLD ) {
+				d->op = d->fuse;
+				vm->fused_sites++;
+				RETRY;
+			}
+			DISPATCH_OP(DECODED(d->opcode));
+		HANDLER(OP_JIT_COUNT):
+			// Branch target. Run what the entry held until it is hot, then compile it.
+			if( ++d->hits == JIT_THRESHOLD ) {
+				if( compile_block(vm, pc) ) {
+					d->op = OP_JIT_ENTER;
+					RETRY;
+				}
+				d->op = d->fuse;
+			}
+			DISPATCH_OP(d->fuse);
+		HANDLER(OP_BREAK):
+			// Breakpoint. Stop before the instruction and take the breakpoint away.
+			vm->break_address = -1;
+			d->op = OP_DECODE;
+			status = NANOVM_BREAK;
+			goto out_of_cycles;
+		HANDLER(OP_WRAP):
+			// The last instruction in memory. Straight-line code goes round to $0000 after it
+			// without a jump, so this is where it stops when the cycles are used up.
+			if( total_cycles >= cycle_limit )
+				goto out_of_cycles;
+			DISPATCH_OP(DECODED(d->opcode));
+		HANDLER(OP_JIT_ENTER):
+			// A block only checks the cycles when it loops, so near the end of them the
+			// interpreter runs the code instead. That way a run stops at the same jump either way.
+			if( total_cycles + JIT_MAX_INSTRUCTIONS >= cycle_limit )
+				DISPATCH_OP(d->fuse);
+			regs.pc = pc;
+			regs.acc = acc;
+			regs.x = x;
+			regs.y = y;
+			regs.z_flag = z_flag;
+			regs.carry_flag = carry_flag;
+			regs.cycles = total_cycles;
+			regs.code_lo = vm->code_lo;
+			regs.code_hi = vm->code_hi;
+			vm->jit_code[pc](&regs);
+			if( regs.cycles == total_cycles ) {
+				DISPATCH_OP(d->fuse);			// Stopped at its first instruction, a store into code
+			}
+			pc = regs.pc;
+			acc = regs.acc;
+			x = regs.x;
+			y = regs.y;
+			z_flag = regs.z_flag;
+			carry_flag = regs.carry_flag;
+			total_cycles = regs.cycles;
+			if( total_cycles >= cycle_limit )
+				goto out_of_cycles;
+			RETRY;
+		
+		// Superinstructions do exactly what their instructions do one at a time, flags and
+		// cycle count included. A store that rewrites the rest of the sequence invalidates
+		// the superinstruction's own entry, and execution then carries on one instruction
+		// at a time from after the store.
+		HANDLER(FUSED_LDA_SUB_STA_JNE):
+			d2 = d + SIZE(LDA_ABS);
+			d3 = d2 + SIZE(SUB_IMM);
+			d4 = d3 + SIZE(STA);
+			acc = memory[d->operand];
+			source = (~d2->operand) + carry_flag;
+			acc += source;
+			zeroflag(acc);
+			carryflag(acc);
+			store(vm, d3->operand, acc);
+			if( d->op == OP_DECODE ) {
+				pc += SIZE(LDA_ABS) + SIZE(SUB_IMM) + SIZE(STA);
+				total_cycles += 2;
+				NEXT;
+			}
+			pc = z_flag == 0 ? d4->operand : pc + SIZE(LDA_ABS) + SIZE(SUB_IMM) + SIZE(STA) + SIZE(JNE);
+			total_cycles += 3;
+			BRANCH;
+		HANDLER(FUSED_LDA_ADD_STA):
+			d2 = d + SIZE(LDA_ABS);
+			d3 = d2 + SIZE(ADD_ABS);
+			acc = memory[d->operand];
+			acc += memory[d2->operand] + carry_flag;
+			zeroflag(acc);
+			carryflag(acc);
+			store(vm, d3->operand, acc);
+			pc += SIZE(LDA_ABS) + SIZE(ADD_ABS) + SIZE(STA);
+			total_cycles += 2;
+			NEXT;
+		HANDLER(FUSED_LDA_STA):
+			d2 = d + SIZE(LDA_ABS);
+			acc = memory[d->operand];
+			zeroflag(acc);
+			store(vm, d2->operand, acc);
+			pc += SIZE(LDA_ABS) + SIZE(STA);
+			total_cycles++;
+			NEXT;
+		HANDLER(FUSED_LDA_IMM_STA):
+			d2 = d + SIZE(LDA_IMM);
+			acc = d->operand;
+			zeroflag(acc);
+			store(vm, d2->operand, acc);
+			pc += SIZE(LDA_IMM) + SIZE(STA);
+			total_cycles++;
+			NEXT;
+		HANDLER(FUSED_CMP_JEQ):
+			d2 = d + SIZE(CMP_IMM);
+			cmp_value = d->operand;
+			z_flag = acc - cmp_value == 0;
+			pc = z_flag == 1 ? d2->operand : pc + SIZE(CMP_IMM) + SIZE(JEQ);
+			total_cycles++;
+			BRANCH;
+		HANDLER(FUSED_CMP_JNE):
+			d2 = d + SIZE(CMP_IMM);
+			cmp_value = d->operand;
+			z_flag = acc - cmp_value == 0;
+			pc = z_flag == 0 ? d2->operand : pc + SIZE(CMP_IMM) + SIZE(JNE);
+			total_cycles++;
+			BRANCH;
+		HANDLER(FUSED_SUB_JNE):
+			d2 = d + SIZE(SUB_IMM);
+			source = (~d->operand) + carry_flag;
+			acc += source;
+			zeroflag(acc);
+			carryflag(acc);
+			pc = z_flag == 0 ? d2->operand : pc + SIZE(SUB_IMM) + SIZE(JNE);
+			total_cycles++;
+			BRANCH;
+		HANDLER(FUSED_DEX_JNE):
+			d2 = d + SIZE(DEX);
+			x--;
+			zeroflag(x);
+			pc = z_flag == 0 ? d2->operand : pc + SIZE(DEX) + SIZE(JNE);
+			total_cycles++;
+			BRANCH;
+		HANDLER(FUSED_DEY_JNE):
+			d2 = d + SIZE(DEY);
+			y--;
+			zeroflag(y);
+			pc = z_flag == 0 ? d2->operand : pc + SIZE(DEY) + SIZE(JNE);
+			total_cycles++;
+			BRANCH;
+		
+		INSTRUCTION(LDA_IMM) 
+			acc = d->operand; 
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(LDA_ABS) 
+			address = d->operand;
+		lda_at:
+			acc = memory[address];
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(STA) 
+			address = d->operand;
+		sta_at:
+			store(vm, address, acc);
+			NEXT;
+		INSTRUCTION(LDX_IMM) 
+			x = d->operand; 
+			zeroflag(x);
+			NEXT;
+		INSTRUCTION(LDX_ABS) 
+			address = d->operand;
+		ldx_at:
+			x = memory[address];
+			zeroflag(x);
+			NEXT;
+		INSTRUCTION(STX) 
+			address = d->operand;
+		stx_at:
+			store(vm, address, x);
+			NEXT;
+		INSTRUCTION(LDY_IMM) 
+			y = d->operand; 
+			zeroflag(y);
+			NEXT;
+		INSTRUCTION(LDY_ABS) 
+			address = d->operand;
+		ldy_at:
+			y = memory[address];
+			zeroflag(y);
+			NEXT;
+		INSTRUCTION(STY) 
+			address = d->operand;
+		sty_at:
+			store(vm, address, y);
+			NEXT;
+		INSTRUCTION(ADD_IMM) 
+			acc += d->operand + carry_flag; 
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT;
+		INSTRUCTION(ADD_ABS) 
+			address = d->operand;
+		add_at:
+			acc += memory[address] + carry_flag; 
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT; 
+		INSTRUCTION(SUB_IMM) 
+			source = (~d->operand) + carry_flag; 	// Two's complement subtraction with carry see: https://en.wikipedia.org/wiki/Carry_flag
+			acc += source; 
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT;
+		INSTRUCTION(SUB_ABS) 
+			address = d->operand;
+		sub_at:
+			acc += (~memory[address]) + carry_flag; 		// Two's complement subtraction with carry see: https://en.wikipedia.org/wiki/Carry_flag
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT;
+		INSTRUCTION(MUL_IMM) 
+			acc *= d->operand; 
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT;
+		INSTRUCTION(MUL_ABS) 
+			address = d->operand;
+			acc *= memory[address]; 
+			zeroflag(acc);
+			carryflag(acc);
+			NEXT;
+		INSTRUCTION(DIV_IMM) 
+			n = d->operand;
+			if( n == 0 )
+				TRAP(NANOVM_DIVIDE_BY_ZERO, DIV_IMM);
+			acc /= n; 
+			zeroflag(acc);
+			//carryflag(acc);
+			NEXT;
+		INSTRUCTION(DIV_ABS) 
+			address = d->operand;
+			n = memory[address];
+			if( n == 0 )
+				TRAP(NANOVM_DIVIDE_BY_ZERO, DIV_ABS);
+			acc /= n; 
+			zeroflag(acc);
+			//carryflag(acc);
+			NEXT;
+		INSTRUCTION(JMP) 
+			address = d->operand;
+			pc = address; 
+			BRANCH;
+		INSTRUCTION(JMP_IND) 
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, JMP_IND);
+			address = memory[address] << 8 | memory[address + 1];
+			pc = address; 
+			BRANCH;
+		INSTRUCTION(JEQ) 
+			address = d->operand;
+			if( z_flag == 1 ) {
+				COUNT_TAKEN();
+				pc = address; 
+				BRANCH;
+			}
+			NEXT;
+		INSTRUCTION(JNE) 
+			address = d->operand;
+			if( z_flag == 0 ) { 
+				COUNT_TAKEN();
+				pc = address;
+				BRANCH;
+			}
+			NEXT;
+		INSTRUCTION(JCS) 
+			address = d->operand;
+			if( carry_flag == 1 ) {
+				COUNT_TAKEN();
+				pc = address; 
+				BRANCH;
+			}
+			NEXT;
+		INSTRUCTION(JCC) 
+			address = d->operand;
+			if( carry_flag == 0 ) { 
+				COUNT_TAKEN();
+				pc = address;
+				BRANCH;
+			}
+			NEXT;
+		INSTRUCTION(HALT) total_cycles++; goto halt;
+		INSTRUCTION(IN)
+			if( read_number(vm, &value) )
+				input = value;
+			acc = input;
+			NEXT;
+		INSTRUCTION(OUT)
+			if( write_number(vm, acc) != 0 ) {
+				// Over the output limit. Stop without running the OUT.
+				pc -= SIZE(OUT);
+				status = NANOVM_OUTPUT_LIMIT;
+				goto out_of_cycles;
+			}
+			NEXT;
+		INSTRUCTION(JSR)	
+			if( ! stack_room(vm, 2) )
+				TRAP(NANOVM_STACK_OVERFLOW, JSR);
+			push(vm, pc >> 8);				// Push return address on stack
+			push(vm, pc & 0xFF);
+			pc = d->operand;			// set pc to subroutine address
+			BRANCH;
+		INSTRUCTION(RTS)
+			if( ! stack_holds(vm, 2) )
+				TRAP(NANOVM_STACK_UNDERFLOW, RTS);
+			buf[1] = pop(vm);				// pop return address from stack
+			buf[0] = pop(vm);
+			pc = buf[0] << 8 | buf[1];	// set pc to return address
+			BRANCH;
+		INSTRUCTION(CMP_IMM)
+			cmp_value = d->operand;
+			if( acc - cmp_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(CMP_ABS)
+			address = d->operand;
+		cmp_at:
+			cmp_value = memory[address]; 
+			if( acc - cmp_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(PUSHA)
+			if( ! stack_room(vm, 1) )
+				TRAP(NANOVM_STACK_OVERFLOW, PUSHA);
+			push(vm, acc);
+			NEXT;
+		INSTRUCTION(POPA)
+			if( ! stack_holds(vm, 1) )
+				TRAP(NANOVM_STACK_UNDERFLOW, POPA);
+			acc = pop(vm);
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(SHL)
+			acc = (acc << 1);					// 6502 & ARM CPU do this. Left-most bit ends up in carry flag.
+			carryflag(acc);
+			zeroflag(acc);
+			goto shift_right;				// SHL carries on into SHR, as it always has
+		INSTRUCTION(SHR)
+		shift_right:
+			if( (acc & 1) == 1 ) carry_flag = 1;	// 6502 & ARM CPU do this. Right-most bit ends up in carry flag
+			acc = (acc >> 1);
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(INC)
+			acc++;
+			carryflag(acc);
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(DEC)
+			acc--;
+			carryflag(acc);
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(NOP)
+			;
+			NEXT;
+		INSTRUCTION(CPX_IMM)
+			cmp_x_value = d->operand;
+			if( x - cmp_x_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(CPX_ABS)
+			address = d->operand;
+			cmp_x_value = memory[address]; 
+			if( x - cmp_x_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(CPY_IMM)
+			cmp_y_value = d->operand;
+			if( y - cmp_y_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(CPY_ABS)
+			address = d->operand;
+			cmp_y_value = memory[address]; 
+			if( y - cmp_y_value == 0 ) z_flag = 1;
+			else z_flag = 0;
+			NEXT;
+		INSTRUCTION(TAX)
+			x = acc;
+			NEXT;
+		INSTRUCTION(TAY)
+			y = acc;
+			NEXT;
+		INSTRUCTION(TXA)
+			acc = x;
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(TYA)
+			acc = y;
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(INX)
+			x++;
+			zeroflag(x);
+			NEXT;
+		INSTRUCTION(INY)
+			y++;
+			zeroflag(y);
+			NEXT;
+		INSTRUCTION(DEX)
+			x--;
+			zeroflag(x);
+			NEXT;
+		INSTRUCTION(DEY)
+			y--;
+			zeroflag(y);
+			NEXT;
+		INSTRUCTION(NEG)
+			acc = (~acc) + 1;
+			NEXT;
+		INSTRUCTION(DUP)
+			if( ! stack_is_empty(vm) ) {
+				if( ! stack_room(vm, 1) )
+					TRAP(NANOVM_STACK_OVERFLOW, DUP);
+				char c = peek(vm);
+				push(vm, c);
+			}
+			NEXT;
+		INSTRUCTION(SWAP)
+			if( ! stack_holds(vm, 2) )
+				TRAP(NANOVM_STACK_UNDERFLOW, SWAP);
+			a = pop(vm);
+			b = pop(vm);
+			push(vm, a);
+			push(vm, b);
+			NEXT;
+		INSTRUCTION(AND_IMM) 
+			acc = acc & d->operand; 
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(AND_ABS) 
+			address = d->operand;
+		and_at:
+			acc = acc & memory[address]; 
+			zeroflag(acc);
+			NEXT; 	
+		INSTRUCTION(OR_IMM) 
+			acc = acc | d->operand; 
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(OR_ABS) 
+			address = d->operand;
+		or_at:
+			acc = acc | memory[address]; 
+			zeroflag(acc);
+			NEXT; 	
+		INSTRUCTION(XOR_IMM) 
+			acc = acc ^ d->operand; 
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(XOR_ABS) 
+			address = d->operand;
+		xor_at:
+			acc = acc ^ memory[address]; 
+			zeroflag(acc);
+			NEXT; 	
+		INSTRUCTION(NOT) 
+			acc = ~acc;  
+			zeroflag(acc);
+			NEXT;
+		INSTRUCTION(CLC) 
+			carry_flag = 0;
+			NEXT;
+		INSTRUCTION(SEC) 
+			carry_flag = 1;
+			NEXT;
+		// The block instructions run on the host's memmove, memset and memcmp, one dispatch for the whole block
+		INSTRUCTION(MEMCPY)
+			if( ! read_block(vm, d->operand, &blk, 1) )
+				TRAP(NANOVM_BAD_ADDRESS, MEMCPY);
+			memmove(memory + blk.dest, memory + blk.source, blk.length);
+			store_block(vm, &blk);
+			NEXT;
+		INSTRUCTION(MEMSET)
+			if( ! read_block(vm, d->operand, &blk, 0) )
+				TRAP(NANOVM_BAD_ADDRESS, MEMSET);
+			memset(memory + blk.dest, acc & 0xff, blk.length);
+			store_block(vm, &blk);
+			NEXT;
+		INSTRUCTION(MEMCMP)
+			if( ! read_block(vm, d->operand, &blk, 1) )
+				TRAP(NANOVM_BAD_ADDRESS, MEMCMP);
+			value = memcmp(memory + blk.dest, memory + blk.source, blk.length);
+			z_flag = value == 0;
+			carry_flag = value < 0;
+			NEXT;
+		// Wide instructions. A word at $ffff would run past the end of memory.
+		INSTRUCTION(LDAW_IMM)
+			acc = d->operand;
+			z_flag = acc == 0;
+			NEXT;
+		INSTRUCTION(LDAW_ABS)
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, LDAW_ABS);
+			acc = LOAD_WORD(address);
+			z_flag = acc == 0;
+			NEXT;
+		INSTRUCTION(STAW)
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, STAW);
+			store(vm, address, acc & 0xff);
+			store(vm, address + 1, acc >> 8);
+			NEXT;
+		INSTRUCTION(ADDW_IMM)
+			word = d->operand;
+			goto add_word;
+		INSTRUCTION(ADDW_ABS)
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, ADDW_ABS);
+			word = LOAD_WORD(address);
+		add_word:
+			value = acc + word + carry_flag;
+			acc = value;
+			carry_flag = value >> 16;
+			z_flag = acc == 0;
+			NEXT;
+		INSTRUCTION(SUBW_IMM)
+			word = d->operand;
+			goto subtract_word;
+		INSTRUCTION(SUBW_ABS)
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, SUBW_ABS);
+			word = LOAD_WORD(address);
+		subtract_word:
+			value = acc + (word ^ 0xffff) + carry_flag;	// Two's complement, as SUB
+			acc = value;
+			carry_flag = value >> 16;
+			z_flag = acc == 0;
+			NEXT;
+		INSTRUCTION(CMPW_IMM)
+			word = d->operand;
+			goto compare_word;
+		INSTRUCTION(CMPW_ABS)
+			address = d->operand;
+			if( address == 0xffff )
+				TRAP(NANOVM_BAD_ADDRESS, CMPW_ABS);
+			word = LOAD_WORD(address);
+		compare_word:
+			z_flag = acc == word;
+			carry_flag = acc >= word;
+			NEXT;
+		INSTRUCTION(INCW)
+			acc++;
+			carry_flag = acc == 0;
+			z_flag = acc == 0;
+			NEXT;
+		INSTRUCTION(DECW)
+			acc--;
+			carry_flag = acc == 0xffff;
+			z_flag = acc == 0;
+			NEXT;
+		// The zero page, indexed and indirect indexed forms work out the address and carry on as the absolute form
+		INSTRUCTION(LDA_ZP)
+			address = d->operand;
+			goto lda_at;
+		INSTRUCTION(STA_ZP)
+			address = d->operand;
+			goto sta_at;
+		INSTRUCTION(ADD_ZP)
+			address = d->operand;
+			goto add_at;
+		INSTRUCTION(SUB_ZP)
+			address = d->operand;
+			goto sub_at;
+		INSTRUCTION(CMP_ZP)
+			address = d->operand;
+			goto cmp_at;
+		INSTRUCTION(AND_ZP)
+			address = d->operand;
+			goto and_at;
+		INSTRUCTION(OR_ZP)
+			address = d->operand;
+			goto or_at;
+		INSTRUCTION(XOR_ZP)
+			address = d->operand;
+			goto xor_at;
+		INSTRUCTION(LDX_ZP)
+			address = d->operand;
+			goto ldx_at;
+		INSTRUCTION(LDY_ZP)
+			address = d->operand;
+			goto ldy_at;
+		INSTRUCTION(STX_ZP)
+			address = d->operand;
+			goto stx_at;
+		INSTRUCTION(STY_ZP)
+			address = d->operand;
+			goto sty_at;
+		INSTRUCTION(LDA_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto lda_at;
+		INSTRUCTION(STA_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto sta_at;
+		INSTRUCTION(ADD_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto add_at;
+		INSTRUCTION(SUB_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto sub_at;
+		INSTRUCTION(CMP_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto cmp_at;
+		INSTRUCTION(AND_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto and_at;
+		INSTRUCTION(OR_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto or_at;
+		INSTRUCTION(XOR_ABS_X)
+			address = d->operand + (x & 0xff);
+			goto xor_at;
+		INSTRUCTION(LDA_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto lda_at;
+		INSTRUCTION(STA_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto sta_at;
+		INSTRUCTION(ADD_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto add_at;
+		INSTRUCTION(SUB_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto sub_at;
+		INSTRUCTION(CMP_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto cmp_at;
+		INSTRUCTION(AND_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto and_at;
+		INSTRUCTION(OR_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto or_at;
+		INSTRUCTION(XOR_ABS_Y)
+			address = d->operand + (y & 0xff);
+			goto xor_at;
+		INSTRUCTION(LDA_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto lda_at;
+		INSTRUCTION(STA_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto sta_at;
+		INSTRUCTION(ADD_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto add_at;
+		INSTRUCTION(SUB_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto sub_at;
+		INSTRUCTION(CMP_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto cmp_at;
+		INSTRUCTION(AND_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto and_at;
+		INSTRUCTION(OR_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto or_at;
+		INSTRUCTION(XOR_IND_Y)
+			address = INDIRECT_Y(d->operand);
+			goto xor_at;
+		ILLEGAL_INSTRUCTION:
+			vm->fault = d->opcode < NUM_OPCODES ? NANOVM_BAD_ADDRESS : NANOVM_ILLEGAL_INSTRUCTION;
+			status = NANOVM_FAULT;
+			goto out_of_cycles;
+        }
+	}
+	
+halt:
+	vm->halted = 1;
+out_of_cycles:
+	vm->pc = pc;
+	vm->acc = acc;
+	vm->x = x;
+	vm->y = y;
+	vm->z_flag = z_flag;
+	vm->carry_flag = carry_flag;
+	vm->cycles = total_cycles;
+	nanovm_flush(vm);
+	return vm->halted ? NANOVM_HALTED : status;
+}
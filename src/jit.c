@@ -0,0 +1,437 @@
+/* jit.c - Template JIT compiler for nanovm basic blocks.
+ *
+ * Each instruction is translated into a short, fixed sequence of x86-64 instructions.
+ * Register use inside a block:
+ *
+ *	rdi		struct jit_regs *
+ *	rsi		memory
+ *	r8d		acc
+ *	r9d		x
+ *	r10d	y
+ *	r11d	z_flag (0 or 1)
+ *	ecx		carry_flag (0 or 1)
+ *	rdx		cycle count
+ *	eax		scratch
+ *
+ * All of them are caller saved, so a block needs no stack frame. A block runs until an
+ * instruction it can't compile (IN, OUT, HALT, JSR, RTS, the stack instructions, DIV and
+ * the shifts), an unconditional jump or a taken branch, and leaves pc pointing at the
+ * instruction the interpreter should run next. A branch back to the start of the block
+ * loops without leaving native code. Stores into decoded code leave the block just
+ * before the store, so the interpreter can run it and invalidate what it overwrites.
+ *
+ * The code buffer is never writable and executable at once. The pages a block is compiled
+ * into are made writable for the compile, then read and execute only again.
+ */
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include "jit.h"
+#include "opcodes.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+
+// x86-64 register numbers
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+#define EDI 7
+#define R8 8
+#define R9 9
+#define R10 10
+#define R11 11
+
+#define ACC R8
+#define X R9
+#define Y R10
+#define Z R11
+#define CARRY ECX
+#define CYCLES EDX
+
+// Condition codes for jcc
+#define CC_B 2
+#define CC_E 4
+#define CC_NE 5
+#define CC_BE 6
+#define CC_A 7
+
+#define REGS(field) offsetof(struct jit_regs, field)
+#define MAX_INSTRUCTION_CODE 128			// Most bytes one instruction and an exit take
+
+static void emit(struct jit_buffer *b, unsigned char byte) {
+	*b->out++ = byte;
+}
+
+static void emit16(struct jit_buffer *b, unsigned int value) {
+	emit(b, value);
+	emit(b, value >> 8);
+}
+
+static void emit32(struct jit_buffer *b, unsigned int value) {
+	emit16(b, value);
+	emit16(b, value >> 16);
+}
+
+// REX prefix, left b->out when it would be empty
+static void rex(struct jit_buffer *b, int w, int reg, int rm) {
+	unsigned char prefix = 0x40 | w << 3 | (reg >> 3) << 2 | rm >> 3;
+	if( prefix != 0x40 )
+		emit(b, prefix);
+}
+
+static void emit_opcode(struct jit_buffer *b, unsigned int op) {
+	if( op > 0xff )
+		emit(b, op >> 8);
+	emit(b, op);
+}
+
+// op reg, rm with both operands registers
+static void rr(struct jit_buffer *b, unsigned int op, int reg, int rm) {
+	rex(b, 0, reg, rm);
+	emit_opcode(b, op);
+	emit(b, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + disp]. Guest memory is addressed with disp32 from rsi, jit_regs with disp8 from rdi.
+static void mem(struct jit_buffer *b, int w, unsigned int op, int reg, int base, unsigned int disp) {
+	rex(b, w, reg, base);
+	emit_opcode(b, op);
+	if( base == EDI ) {
+		emit(b, 0x40 | (reg & 7) << 3 | (base & 7));
+		emit(b, disp);
+	} else {
+		emit(b, 0x80 | (reg & 7) << 3 | (base & 7));
+		emit32(b, disp);
+	}
+}
+
+// op r32, imm32 from the 0x81 group: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp
+static void alu_imm(struct jit_buffer *b, int ext, int rm, unsigned int value) {
+	rr(b, 0x81, ext, rm);
+	emit32(b, value);
+}
+
+static void mov_imm(struct jit_buffer *b, int reg, unsigned int value) {
+	rex(b, 0, 0, reg);
+	emit(b, 0xb8 | (reg & 7));
+	emit32(b, value);
+}
+
+// jcc or jmp with a 32 bit displacement. Returns the displacement to patch.
+static unsigned char *jump(struct jit_buffer *b, int cc) {
+	if( cc < 0 )
+		emit(b, 0xe9);
+	else
+		emit_opcode(b, 0x0f80 | cc);
+	emit32(b, 0);
+	return b->out - 4;
+}
+
+static void patch(unsigned char *displacement, unsigned char *target) {
+	int rel = target - (displacement + 4);
+	memcpy(displacement, &rel, 4);
+}
+
+// Keep the low 16 bits of a register, as the VM's 16 bit registers do
+static void truncate16(struct jit_buffer *b, int reg) {
+	rr(b, 0x0fb7, reg, reg);					// movzx reg, reg16
+}
+
+// z_flag = low byte of reg is zero
+static void set_zero(struct jit_buffer *b, int reg) {
+	rr(b, 0x84, reg, reg);						// test reg8, reg8
+	rr(b, 0x0f94, 0, Z);						// sete r11b
+}
+
+// carry_flag = bit 8 of acc
+static void set_carry(struct jit_buffer *b) {
+	rr(b, 0x0fba, 4, ACC);						// bt r8d, 8
+	emit(b, 8);
+	rr(b, 0x0f92, 0, CARRY);					// setc cl
+}
+
+// z_flag = reg equals the value in eax or an immediate
+static void compare(struct jit_buffer *b, int reg, int immediate, unsigned int value) {
+	rr(b, 0x31, Z, Z);							// xor r11d, r11d
+	if( immediate )
+		alu_imm(b, 7, reg, value);
+	else
+		rr(b, 0x39, EAX, reg);
+	rr(b, 0x0f94, 0, Z);
+}
+
+static void load_byte(struct jit_buffer *b, int reg, unsigned short address) {
+	mem(b, 0, 0x0fb6, reg, ESI, address);		// movzx reg, byte [rsi + address]
+}
+
+// Write the registers back, set pc, count the instructions run and return
+static void exit_block(struct jit_buffer *b, unsigned short pc, unsigned int cycles) {
+	emit(b, 0x66);
+	mem(b, 0, 0xc7, 0, EDI, REGS(pc));
+	emit16(b, pc);
+	if( cycles > 0 ) {
+		rex(b, 1, 0, CYCLES);
+		alu_imm(b, 0, CYCLES, cycles);			// add rdx, cycles
+	}
+	mem(b, 1, 0x89, CYCLES, EDI, REGS(cycles));
+	emit(b, 0x66);
+	mem(b, 0, 0x89, ACC, EDI, REGS(acc));
+	emit(b, 0x66);
+	mem(b, 0, 0x89, X, EDI, REGS(x));
+	emit(b, 0x66);
+	mem(b, 0, 0x89, Y, EDI, REGS(y));
+	mem(b, 0, 0x88, Z, EDI, REGS(z_flag));
+	mem(b, 0, 0x88, CARRY, EDI, REGS(carry_flag));
+	emit(b, 0xc3);
+}
+
+// Jump back to the top of the block unless the cycle limit has been reached
+static void loop_back(struct jit_buffer *b, unsigned char *top, unsigned short start, unsigned int cycles) {
+	rex(b, 1, 0, CYCLES);
+	alu_imm(b, 0, CYCLES, cycles);				// add rdx, cycles
+	mem(b, 1, 0x3b, CYCLES, EDI, REGS(cycle_limit));
+	patch(jump(b, CC_B), top);
+	exit_block(b, start, 0);
+}
+
+// Leave the block before a store that would hit decoded code
+static void check_store(struct jit_buffer *b, unsigned short address, unsigned short pc, unsigned int cycles) {
+	unsigned char *below, *above;
+
+	mem(b, 0, 0x81, 7, EDI, REGS(code_lo));	// cmp dword [rdi + code_lo], address
+	emit32(b, address);
+	below = jump(b, CC_A);
+	mem(b, 0, 0x81, 7, EDI, REGS(code_hi));
+	emit32(b, address);
+	above = jump(b, CC_BE);
+	exit_block(b, pc, cycles);
+	patch(below, b->out);
+	patch(above, b->out);
+}
+
+int jit_init(struct jit_buffer *b) {
+	b->start = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if( b->start == MAP_FAILED ) {
+		b->start = NULL;
+		return 0;
+	}
+	b->out = b->start;
+	b->end = b->start + JIT_BUFFER_SIZE;
+	return 1;
+}
+
+// Throw away every block compiled into the buffer
+void jit_reset(struct jit_buffer *b) {
+	b->out = b->start;
+}
+
+void jit_free(struct jit_buffer *b) {
+	if( b->start != NULL )
+		munmap(b->start, JIT_BUFFER_SIZE);
+	b->start = NULL;
+}
+
+static jit_block compile(struct jit_buffer *b, unsigned char *memory, unsigned short address, unsigned int limit, unsigned int *end) {
+	unsigned char *block = b->out;
+	unsigned char *top, *skip;
+	unsigned int pc = address;
+	unsigned int cycles = 0;				// Instructions run since the top of the block
+	unsigned int count = 0;
+	unsigned char opcode;
+	unsigned short operand;
+	unsigned int size;
+	int cc;
+
+	// Load the registers
+	mem(b, 1, 0x8b, ESI, EDI, REGS(memory));
+	mem(b, 0, 0x0fb7, ACC, EDI, REGS(acc));
+	mem(b, 0, 0x0fb7, X, EDI, REGS(x));
+	mem(b, 0, 0x0fb7, Y, EDI, REGS(y));
+	mem(b, 0, 0x0fb6, Z, EDI, REGS(z_flag));
+	mem(b, 0, 0x0fb6, CARRY, EDI, REGS(carry_flag));
+	mem(b, 1, 0x8b, CYCLES, EDI, REGS(cycles));
+	top = b->out;
+
+	for(;;) {
+		if( count == JIT_MAX_INSTRUCTIONS || b->end - b->out < 2 * MAX_INSTRUCTION_CODE || pc > 0xfffd || pc == limit )
+			break;
+		opcode = memory[pc];
+		operand = 0;
+		size = 1;
+		switch( opcode ) {
+		case LDA_IMM: case ADD_IMM: case SUB_IMM: case MUL_IMM: case CMP_IMM: case LDX_IMM: case LDY_IMM:
+		case CPX_IMM: case CPY_IMM: case AND_IMM: case OR_IMM: case XOR_IMM:
+			operand = memory[pc + 1];
+			size = 2;
+			break;
+		case LDA_ABS: case STA: case ADD_ABS: case SUB_ABS: case MUL_ABS: case JMP: case JEQ: case JNE:
+		case CMP_ABS: case LDX_ABS: case LDY_ABS: case STX: case STY: case CPX_ABS: case CPY_ABS:
+		case AND_ABS: case OR_ABS: case XOR_ABS: case JCS: case JCC:
+			operand = memory[pc + 1] << 8 | memory[pc + 2];
+			size = 3;
+			break;
+		case INC: case DEC: case NOP: case TAX: case TAY: case TXA: case TYA: case INX: case INY:
+		case DEX: case DEY: case NEG: case NOT: case CLC: case SEC:
+			break;
+		default:
+			goto done;						// Leave it to the interpreter
+		}
+
+		switch( opcode ) {
+		case LDA_IMM: mov_imm(b, ACC, operand); mov_imm(b, Z, operand == 0); break;
+		case LDX_IMM: mov_imm(b, X, operand); mov_imm(b, Z, operand == 0); break;
+		case LDY_IMM: mov_imm(b, Y, operand); mov_imm(b, Z, operand == 0); break;
+		case LDA_ABS: load_byte(b, ACC, operand); set_zero(b, ACC); break;
+		case LDX_ABS: load_byte(b, X, operand); set_zero(b, X); break;
+		case LDY_ABS: load_byte(b, Y, operand); set_zero(b, Y); break;
+		case STA: check_store(b, operand, pc, cycles); mem(b, 0, 0x88, ACC, ESI, operand); break;
+		case STX: check_store(b, operand, pc, cycles); mem(b, 0, 0x88, X, ESI, operand); break;
+		case STY: check_store(b, operand, pc, cycles); mem(b, 0, 0x88, Y, ESI, operand); break;
+		case ADD_IMM:
+			rr(b, 0x01, CARRY, ACC);
+			alu_imm(b, 0, ACC, operand);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case ADD_ABS:
+			load_byte(b, EAX, operand);
+			rr(b, 0x01, CARRY, EAX);
+			rr(b, 0x01, EAX, ACC);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case SUB_IMM:
+			// The interpreter truncates (~operand) + carry to a byte before adding it
+			rr(b, 0x89, CARRY, EAX);
+			alu_imm(b, 0, EAX, ~operand & 0xff);
+			rr(b, 0x0fb6, EAX, EAX);			// movzx eax, al
+			rr(b, 0x01, EAX, ACC);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case SUB_ABS:
+			// ...but not ~memory + carry
+			load_byte(b, EAX, operand);
+			rr(b, 0xf7, 2, EAX);				// not eax
+			rr(b, 0x01, CARRY, EAX);
+			rr(b, 0x01, EAX, ACC);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case MUL_IMM:
+			rr(b, 0x69, ACC, ACC);				// imul r8d, r8d, operand
+			emit32(b, operand);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case MUL_ABS:
+			load_byte(b, EAX, operand);
+			rr(b, 0x0faf, ACC, EAX);
+			truncate16(b, ACC); set_zero(b, ACC); set_carry(b);
+			break;
+		case CMP_IMM: compare(b, ACC, 1, operand); break;
+		case CPX_IMM: compare(b, X, 1, operand); break;
+		case CPY_IMM: compare(b, Y, 1, operand); break;
+		case CMP_ABS: load_byte(b, EAX, operand); compare(b, ACC, 0, 0); break;
+		case CPX_ABS: load_byte(b, EAX, operand); compare(b, X, 0, 0); break;
+		case CPY_ABS: load_byte(b, EAX, operand); compare(b, Y, 0, 0); break;
+		case INC: alu_imm(b, 0, ACC, 1); truncate16(b, ACC); set_carry(b); set_zero(b, ACC); break;
+		case DEC: alu_imm(b, 5, ACC, 1); truncate16(b, ACC); set_carry(b); set_zero(b, ACC); break;
+		case INX: alu_imm(b, 0, X, 1); truncate16(b, X); set_zero(b, X); break;
+		case DEX: alu_imm(b, 5, X, 1); truncate16(b, X); set_zero(b, X); break;
+		case INY: alu_imm(b, 0, Y, 1); truncate16(b, Y); set_zero(b, Y); break;
+		case DEY: alu_imm(b, 5, Y, 1); truncate16(b, Y); set_zero(b, Y); break;
+		case TAX: rr(b, 0x89, ACC, X); break;
+		case TAY: rr(b, 0x89, ACC, Y); break;
+		case TXA: rr(b, 0x89, X, ACC); set_zero(b, ACC); break;
+		case TYA: rr(b, 0x89, Y, ACC); set_zero(b, ACC); break;
+		case NEG: rr(b, 0xf7, 3, ACC); truncate16(b, ACC); break;
+		case NOT: rr(b, 0xf7, 2, ACC); truncate16(b, ACC); set_zero(b, ACC); break;
+		case AND_IMM: alu_imm(b, 4, ACC, operand); set_zero(b, ACC); break;
+		case OR_IMM: alu_imm(b, 1, ACC, operand); set_zero(b, ACC); break;
+		case XOR_IMM: alu_imm(b, 6, ACC, operand); set_zero(b, ACC); break;
+		case AND_ABS: load_byte(b, EAX, operand); rr(b, 0x21, EAX, ACC); set_zero(b, ACC); break;
+		case OR_ABS: load_byte(b, EAX, operand); rr(b, 0x09, EAX, ACC); set_zero(b, ACC); break;
+		case XOR_ABS: load_byte(b, EAX, operand); rr(b, 0x31, EAX, ACC); set_zero(b, ACC); break;
+		case CLC: rr(b, 0x31, CARRY, CARRY); break;
+		case SEC: mov_imm(b, CARRY, 1); break;
+		case NOP: break;
+		case JMP:
+			if( operand == address )
+				loop_back(b, top, address, cycles + 1);
+			else
+				exit_block(b, operand, cycles + 1);
+			pc += 3;
+			count++;
+			goto compiled;
+		case JEQ: case JNE: case JCS: case JCC:
+			// Taken: leave the block, or loop. Not taken: carry on compiling.
+			if( opcode == JEQ || opcode == JNE )
+				rr(b, 0x85, Z, Z);
+			else
+				rr(b, 0x85, CARRY, CARRY);
+			cc = opcode == JEQ || opcode == JCS ? CC_E : CC_NE;
+			skip = jump(b, cc);
+			if( operand == address )
+				loop_back(b, top, address, cycles + 1);
+			else
+				exit_block(b, operand, cycles + 1);
+			patch(skip, b->out);
+			break;
+		}
+
+		pc += size;
+		cycles++;
+		count++;
+	}
+
+done:
+	if( count == 0 ) {
+		b->out = block;
+		return NULL;
+	}
+	exit_block(b, pc, cycles);
+compiled:
+	*end = pc;
+	return (jit_block) block;
+}
+
+/* Compile the block starting at address, stopping before limit. Returns NULL if the first
+ * instruction can't be compiled or the code buffer is full. end is set to the address after the last
+ * instruction compiled, so stores into [address, end) can drop the block.
+ */
+jit_block jit_compile(struct jit_buffer *b, unsigned char *memory, unsigned short address, unsigned int limit, unsigned int *end) {
+	jit_block block;
+
+	if( b->start == NULL || b->end - b->out < 2 * MAX_INSTRUCTION_CODE )
+		return NULL;
+
+	// From the page the block starts in to the end of the buffer, which is as far as it can go
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned char *from = b->start + (b->out - b->start) / page_size * page_size;
+	if( mprotect(from, b->end - from, PROT_READ | PROT_WRITE) != 0 )
+		return NULL;
+	block = compile(b, memory, address, limit, end);
+	if( mprotect(from, b->end - from, PROT_READ | PROT_EXEC) != 0 ) {
+		// The blocks before this one are in pages that can't run now, so give up on the JIT
+		jit_free(b);
+		return NULL;
+	}
+	return block;
+}
+
+#else
+
+int jit_init(struct jit_buffer *b) {
+	b->start = NULL;
+	return 0;
+}
+
+void jit_reset(struct jit_buffer *b) {
+}
+
+void jit_free(struct jit_buffer *b) {
+}
+
+jit_block jit_compile(struct jit_buffer *b, unsigned char *memory, unsigned short address, unsigned int limit, unsigned int *end) {
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef jit
+#define jit
+
+/* jit.h - Template JIT compiler for nanovm basic blocks.
+ *
+ * A compiled block is a native function that runs the instructions from its start address
+ * up to the first instruction it can't compile, keeping acc, x, y and the flags in host
+ * registers. It reads the machine state from a struct jit_regs, and writes it back along
+ * with the address the interpreter should carry on from.
+ */
+
+#define JIT_THRESHOLD 32						// Executions of a branch target before it is compiled
+#define JIT_MAX_INSTRUCTIONS 128				// Longest block compiled
+#define JIT_BUFFER_SIZE (1024 * 1024)			// Size of the executable code buffer
+
+struct jit_regs {
+	unsigned char *memory;						// The memory
+	unsigned long cycles;						// Cycle count, updated by the block
+	unsigned long cycle_limit;					// A looping block returns once cycles reach this
+	unsigned int code_lo, code_hi;				// Decoded code. Stores into it go back to the interpreter.
+	unsigned short pc;							// Where to carry on after the block
+	unsigned short acc;
+	unsigned short x;
+	unsigned short y;
+	unsigned char z_flag;
+	unsigned char carry_flag;
+};
+
+// Executable memory the blocks are compiled into. Each VM has its own.
+struct jit_buffer {
+	unsigned char *start;
+	unsigned char *out;							// Where the next byte of code goes
+	unsigned char *end;
+};
+
+typedef void (*jit_block)(struct jit_regs *regs);
+
+int jit_init(struct jit_buffer *b);
+void jit_reset(struct jit_buffer *b);
+void jit_free(struct jit_buffer *b);
+jit_block jit_compile(struct jit_buffer *b, unsigned char *memory, unsigned short address, unsigned int limit, unsigned int *end);
+
+#endif
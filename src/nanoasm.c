@@ -3,18 +3,27 @@
  *
  * Grammar:
  *
- * assemble ::= org <number> <statement>* EOF
+ * assemble ::= org <operand> <statement>* EOF
  * statement ::= <newline> | 
  *               <comment> | 
- *               <code> [<comment>] <newline>
+ *               [<label>] [<code>] [<comment>] <newline> |
+ *               <name> EQU <operand> [<comment>] <newline>
  *
  * comment ::= ; <string> <newline>
  * string ::= <empty> | <printable character>
- * code ::= <mnemonic> [<address_mode>] [<operand>]
- *          | mnemonic (<operand>)
+ * label ::= <name>:
+ * code ::= <mnemonic> [<address_mode>] [<operand>] [<index>]
+ *          | mnemonic (<operand>) [,Y]
  * address_mode::= #
- * operand ::= <number>
+ * index ::= ,X | ,Y
+ * operand ::= <term> [(+ | -) <term>]*
+ * term ::= <number> | <name> | < <term> | > <term>
  * number ::= <decimal> | $<hex> | %<binary>
+ * name ::= <letter or _> [<letter, digit or _>]*
+ *
+ * The source is assembled twice. The first pass finds the address of every label, so an operand
+ * can use a label defined further down. The second pass writes the code. An EQU can only use
+ * names defined above it.
  *
  * Author: Mario Gianota July 2021
  */
@@ -24,41 +33,243 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include "opcodes.h"
+#include "object.h"
 
-FILE *fp;		// Assembly language source file
-FILE *ofp;		// Assembled output file
+unsigned char *src;			// Assembly language source file, read in whole
+unsigned char *src_pos;		// Next character
+unsigned char *src_end;
+unsigned char *obj;			// Assembled output, written in one go at the end
+size_t obj_size;
+size_t obj_capacity;
+FILE *mfp;		// Debug map (-g), in memory until the end too, or NULL
+char *map_text;
+size_t map_size;
 int look;		// Lookahead character
 int line_no;	// Track line numbers
 int buf[6];		// Mnemonic buffer
 
-char tokens[][6] = {
-{"LDA"}, {"STA"}, {"ADD"}, {"SUB"}, {"MUL"}, 
-{"DIV"}, {"JMP"}, {"JEQ"}, {"JNE"}, {"HALT"}, {"IN"}, {"OUT"},{"ORG"},
-{"JSR"}, {"RTS"}, {"CMP"}, {"PUSHA"}, {"POPA"}, {"SHL"}, {"SHR"}, 
-{"INC"}, {"DEC"}, {"NOP"}, {"LDX"}, {"LDY"}, {"STX"}, {"STY"},
-{"CPX"}, {"CPY"}, {"TAX"}, {"TAY"}, {"TXA"}, {"TYA"},
-{"INX"}, {"INY"}, {"DEX"}, {"DEY"},
-{"NEG"},{"DUP"}, {"SWAP"}, {"AND"}, {"OR"},{"XOR"},{"NOT"},
-{"CLC"}, {"SEC"}, {"JCS"}, {"JCC"}};
+// Addressing modes, as address_mode() finds them
+#define ABSOLUTE 0				// A two byte address, or no operand at all
+#define IMMEDIATE 1				// #n, one byte
+#define INDIRECT 2				// (address)
+#define IMPLIED 3				// No operand
+#define ZERO_PAGE 4				// <address, one byte
+#define ABSOLUTE_X 5			// address,X
+#define ABSOLUTE_Y 6			// address,Y
+#define INDIRECT_Y 7			// (zero page address),Y
+#define IMMEDIATE_WORD 8		// #n, two bytes, for the wide instructions
+#define NUM_MODES 9
+#define NONE 0xff				// No opcode for the mode
+
+const int operand_width[NUM_MODES] = { 2, 1, 2, 0, 1, 2, 2, 1, 2 };
+const char *mode_names[NUM_MODES] = { "absolute", "immediate", "indirect", "implied", "zero page",
+	"absolute,X", "absolute,Y", "(indirect),Y", "immediate" };
+
+// Every mnemonic with its opcode for each addressing mode
+struct mnemonic {
+	char name[7];
+	unsigned char opcode[NUM_MODES];		// One for each addressing mode, in the order above
+};
+
+struct mnemonic mnemonics[] = {
+	{"LDA", { LDA_ABS, LDA_IMM, NONE, NONE, LDA_ZP, LDA_ABS_X, LDA_ABS_Y, LDA_IND_Y, NONE }},
+	{"STA", { STA, NONE, NONE, NONE, STA_ZP, STA_ABS_X, STA_ABS_Y, STA_IND_Y, NONE }},
+	{"ADD", { ADD_ABS, ADD_IMM, NONE, NONE, ADD_ZP, ADD_ABS_X, ADD_ABS_Y, ADD_IND_Y, NONE }},
+	{"SUB", { SUB_ABS, SUB_IMM, NONE, NONE, SUB_ZP, SUB_ABS_X, SUB_ABS_Y, SUB_IND_Y, NONE }},
+	{"MUL", { MUL_ABS, MUL_IMM, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"DIV", { DIV_ABS, DIV_IMM, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JMP", { JMP, NONE, JMP_IND, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JEQ", { JEQ, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JNE", { JNE, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JCS", { JCS, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JCC", { JCC, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"JSR", { JSR, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"RTS", { NONE, NONE, NONE, RTS, NONE, NONE, NONE, NONE, NONE }},
+	{"HALT", { NONE, NONE, NONE, HALT, NONE, NONE, NONE, NONE, NONE }},
+	{"IN", { NONE, NONE, NONE, IN, NONE, NONE, NONE, NONE, NONE }},
+	{"OUT", { NONE, NONE, NONE, OUT, NONE, NONE, NONE, NONE, NONE }},
+	{"CMP", { CMP_ABS, CMP_IMM, NONE, NONE, CMP_ZP, CMP_ABS_X, CMP_ABS_Y, CMP_IND_Y, NONE }},
+	{"PUSHA", { NONE, NONE, NONE, PUSHA, NONE, NONE, NONE, NONE, NONE }},
+	{"POPA", { NONE, NONE, NONE, POPA, NONE, NONE, NONE, NONE, NONE }},
+	{"SHL", { NONE, NONE, NONE, SHL, NONE, NONE, NONE, NONE, NONE }},
+	{"SHR", { NONE, NONE, NONE, SHR, NONE, NONE, NONE, NONE, NONE }},
+	{"INC", { NONE, NONE, NONE, INC, NONE, NONE, NONE, NONE, NONE }},
+	{"DEC", { NONE, NONE, NONE, DEC, NONE, NONE, NONE, NONE, NONE }},
+	{"NOP", { NONE, NONE, NONE, NOP, NONE, NONE, NONE, NONE, NONE }},
+	{"LDX", { LDX_ABS, LDX_IMM, NONE, NONE, LDX_ZP, NONE, NONE, NONE, NONE }},
+	{"LDY", { LDY_ABS, LDY_IMM, NONE, NONE, LDY_ZP, NONE, NONE, NONE, NONE }},
+	{"STX", { STX, NONE, NONE, NONE, STX_ZP, NONE, NONE, NONE, NONE }},
+	{"STY", { STY, NONE, NONE, NONE, STY_ZP, NONE, NONE, NONE, NONE }},
+	{"CPX", { CPX_ABS, CPX_IMM, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"CPY", { CPY_ABS, CPY_IMM, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"TAX", { NONE, NONE, NONE, TAX, NONE, NONE, NONE, NONE, NONE }},
+	{"TAY", { NONE, NONE, NONE, TAY, NONE, NONE, NONE, NONE, NONE }},
+	{"TXA", { NONE, NONE, NONE, TXA, NONE, NONE, NONE, NONE, NONE }},
+	{"TYA", { NONE, NONE, NONE, TYA, NONE, NONE, NONE, NONE, NONE }},
+	{"INX", { NONE, NONE, NONE, INX, NONE, NONE, NONE, NONE, NONE }},
+	{"INY", { NONE, NONE, NONE, INY, NONE, NONE, NONE, NONE, NONE }},
+	{"DEX", { NONE, NONE, NONE, DEX, NONE, NONE, NONE, NONE, NONE }},
+	{"DEY", { NONE, NONE, NONE, DEY, NONE, NONE, NONE, NONE, NONE }},
+	{"NEG", { NONE, NONE, NONE, NEG, NONE, NONE, NONE, NONE, NONE }},
+	{"DUP", { NONE, NONE, NONE, DUP, NONE, NONE, NONE, NONE, NONE }},
+	{"SWAP", { NONE, NONE, NONE, SWAP, NONE, NONE, NONE, NONE, NONE }},
+	{"AND", { AND_ABS, AND_IMM, NONE, NONE, AND_ZP, AND_ABS_X, AND_ABS_Y, AND_IND_Y, NONE }},
+	{"OR", { OR_ABS, OR_IMM, NONE, NONE, OR_ZP, OR_ABS_X, OR_ABS_Y, OR_IND_Y, NONE }},
+	{"XOR", { XOR_ABS, XOR_IMM, NONE, NONE, XOR_ZP, XOR_ABS_X, XOR_ABS_Y, XOR_IND_Y, NONE }},
+	{"NOT", { NONE, NONE, NONE, NOT, NONE, NONE, NONE, NONE, NONE }},
+	{"CLC", { NONE, NONE, NONE, CLC, NONE, NONE, NONE, NONE, NONE }},
+	{"SEC", { NONE, NONE, NONE, SEC, NONE, NONE, NONE, NONE, NONE }},
+	{"MEMCPY", { MEMCPY, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"MEMSET", { MEMSET, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"MEMCMP", { MEMCMP, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"LDAW", { LDAW_ABS, NONE, NONE, NONE, NONE, NONE, NONE, NONE, LDAW_IMM }},
+	{"STAW", { STAW, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }},
+	{"ADDW", { ADDW_ABS, NONE, NONE, NONE, NONE, NONE, NONE, NONE, ADDW_IMM }},
+	{"SUBW", { SUBW_ABS, NONE, NONE, NONE, NONE, NONE, NONE, NONE, SUBW_IMM }},
+	{"CMPW", { CMPW_ABS, NONE, NONE, NONE, NONE, NONE, NONE, NONE, CMPW_IMM }},
+	{"INCW", { NONE, NONE, NONE, INCW, NONE, NONE, NONE, NONE, NONE }},
+	{"DECW", { NONE, NONE, NONE, DECW, NONE, NONE, NONE, NONE, NONE }},
+	{"ORG", { NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE, NONE }}			// Directive, see org()
+};
+
+int num_mnemonics = sizeof(mnemonics) / sizeof(mnemonics[0]);
+
+/* Mnemonic lookup. HASH_MULTIPLIER was picked so every mnemonic above gets a slot of its own,
+ * so a lookup is one hash and one compare. A new mnemonic that collides still works, it just
+ * takes the next free slot.
+ */
+#define HASH_SIZE 128
+#define HASH_MULTIPLIER 0xc01cb771u
 
-int num_tokens = 48;
+struct mnemonic *hash_table[HASH_SIZE];
 
-int mindex;		// match token index
+struct mnemonic *mn;			// Mnemonic just read
 
 unsigned char instruction;		// The assembled instruction
-unsigned char amode;			// Addressing mode 0 = absolute, 1 = immmediate
+unsigned char amode;			// Addressing mode
 unsigned short operand;			// Instruction's operand
+unsigned short org_address;		// Where the program is loaded
+
+// Labels and EQU constants
+#define SYMBOL_TABLE_SIZE 4096
+#define MAX_NAME 80
+
+struct symbol {
+	char *name;
+	unsigned short value;
+	int line;					// Where it was defined
+	int label;					// A label rather than an EQU
+	int external;				// Defined in another module (-c)
+	int global;					// Exported from the module with GLOBAL (-c)
+	int index;					// An external's place in the object file's symbols
+	struct symbol *next;		// Next symbol with the same hash
+};
 
+struct symbol *symbols[SYMBOL_TABLE_SIZE];
 
-char* ASM_VERSION = "NanoASM Version: 0.5.2 July 2021";
+/* Modules (-c). The code is assembled as if loaded at address 0, with no ORG, and every
+ * operand that uses a label or an external gets a relocation for nanold to fix up.
+ */
+int object_mode;
+int header_size = 4;			// Bytes before the code in the output: magic and ORG, or none
+struct symbol **externs;		// In the order they were first used
+int num_externs;
+int externs_capacity;
+struct object_relocation *relocations;
+int num_relocations;
+int relocations_capacity;
+int term_label;					// The last term was a label
+struct symbol *term_external;	// The last term was this external
+int operand_labels;				// Labels added to the operand, less those subtracted
+int operand_externals;			// Same for externals
+struct symbol *operand_external;
+int operand_byte;				// NANOOBJ_LOW or NANOOBJ_HIGH if the operand is < or > of an address
+long operand_address;			// The address it is < or > of
+
+int pass;						// 1 finds the labels' addresses, 2 writes the code
+int undefined;					// The last operand used a name that isn't defined (yet)
+int operand_low;				// The operand starts with <, so it is a zero page address
+int last_label;					// The last term was a label
+int label_operand;				// The last operand was a label on its own
+const unsigned char *operand_text;	// Where the last operand is in the source
+int operand_length;
 
+/* The peephole optimiser (-O). Each round assembles the source, collecting the instructions in
+ * code[], then looks for instructions it can remove or replace with cheaper ones. What it finds
+ * goes in rewrites[], by the instruction's place in the source, and the next round assembles with
+ * those changes. Labels move to suit, and it stops once a round finds nothing more to do.
+ */
+#define MAX_ROUNDS 16
+#define KEEP 0
+#define DELETE 1
+#define REPLACE 2
+
+struct rewrite {
+	unsigned char action;
+	struct mnemonic *mn;		// What to REPLACE it with
+	unsigned char amode;
+};
+
+struct instruction {
+	int index;					// Which instruction in the source, counting from 0
+	unsigned char opcode;
+	unsigned short operand;
+	unsigned short address;
+	const unsigned char *text;	// The operand, as written
+	int text_length;
+	int target;					// A label points at it
+	int label_operand;			// The operand is a label on its own
+};
+
+int optimise;
+struct rewrite *rewrites;		// One per instruction in the source, or NULL
+int num_instructions;			// Instructions read so far this pass
+struct instruction *code_list;	// What the second pass assembled
+int code_size;
+int code_capacity;
+int label_here;					// A label points at the next instruction
+int warned;						// Warnings are only given on the first round
+
+
+char* ASM_VERSION = "NanoASM Version: 0.8";
+
+// line_no is the line look is on
 void la() {
-	look = fgetc(fp);
 	if( look == '\n' )
 		line_no++;
+	look = src_pos < src_end ? *src_pos++ : EOF;
 	}
 
+void warn_system_memory() {
+	printf("Warning: Program originates in an area of memory used by the system. Addresses $0x00 to $0xFF are reserved for system use.\n");
+}
+
+void report_optimiser(const char *source, unsigned long bytes, int instructions) {
+	printf("%s: Optimiser saved %lu bytes and %d instructions.\n", source, bytes, instructions);
+}
+
+// Append to the assembled output
+void emit(const void *bytes, size_t n) {
+	if( obj_size + n > obj_capacity ) {
+		obj_capacity = obj_capacity * 2 + n;
+		obj = realloc(obj, obj_capacity);
+		if( obj == NULL ) {
+			printf("Error: Out of memory.\n");
+			exit(1);
+		}
+	}
+	memcpy(obj + obj_size, bytes, n);
+	obj_size += n;
+}
+
 void skipWS() {
 	while( look == ' ' || look == '\t')
 		la();
@@ -68,6 +279,10 @@ int is_alpha(int c) {
 	return (c >='a' && c <= 'z') || (c >='A' && c <='Z');
 }
 
+int is_name_start(int c) {
+	return is_alpha(c) || c == '_';
+}
+
 int is_digit(int c) {
 	return c == '0' || c == '1' || c == '2' || c == '3' || c == '4' || c == '5' ||
 		c == '6' || c == '7' || c == '8' || c == '9';
@@ -138,30 +353,99 @@ void comment() {
 	la();
 }
 
-void address_mode() {
-	skipWS();
-	if( look == '#' ) {
-		// immediate mode
-		amode = 1;
-		la();
-	} else if( look == '(' ) {
-		amode = 2;
+// Read a name into buf, which has room for MAX_NAME characters
+void read_name(char *buf) {
+	int j = 0;
+	
+	while( is_name_start(look) || is_digit(look) ) {
+		buf[j++] = (char)look;
 		la();
-	} else {
-		// absolute mode
-		amode = 0;
-	} 
+		if( j >= MAX_NAME ) {
+			printf("Syntax error. Line: %d. Name too long.\n", line_no);
+			exit(1);
+		}
+	}
+	buf[j] = '\0';
 }
 
-unsigned short _operand() {
-	skipWS();
-	char num[16];
+unsigned int symbol_hash(const char *name) {
+	unsigned int h = 0;
+	
+	while( *name )
+		h = h * 33 + (unsigned char) *name++;
+	return h % SYMBOL_TABLE_SIZE;
+}
+
+struct symbol *find_symbol(const char *name) {
+	struct symbol *sym;
+	
+	for(sym = symbols[symbol_hash(name)]; sym != NULL; sym = sym->next)
+		if( strcmp(sym->name, name) == 0 )
+			return sym;
+	return NULL;
+}
+
+// Put a symbol in the table without looking for one with the same name. Which pass may add
+// it, and what a duplicate means, is up to the caller.
+struct symbol *add_symbol(const char *name, unsigned short value) {
+	struct symbol *sym = calloc(1, sizeof(struct symbol));
+	sym->name = strdup(name);
+	sym->value = value;
+	sym->line = line_no;
+	unsigned int h = symbol_hash(name);
+	sym->next = symbols[h];
+	symbols[h] = sym;
+	return sym;
+}
+
+// Symbols are defined on the first pass. The second pass gives them the same values again.
+void define_symbol(const char *name, unsigned short value, int label) {
+	struct symbol *sym;
+	
+	if( pass != 1 )
+		return;
+	sym = find_symbol(name);
+	if( sym != NULL ) {
+		printf("Syntax error. Line: %d. '%s' is already defined on line %d.\n", line_no, name, sym->line);
+		exit(1);
+	}
+	sym = add_symbol(name, value);
+	sym->label = label;
+}
+
+// A name a module uses but doesn't define. nanold finds it in another module.
+struct symbol *add_external(const char *name) {
+	struct symbol *sym = add_symbol(name, 0);
+	sym->external = 1;
+	sym->index = num_externs;
+	if( num_externs == externs_capacity ) {
+		externs_capacity = externs_capacity * 2 + 16;
+		externs = realloc(externs, externs_capacity * sizeof(struct symbol *));
+	}
+	externs[num_externs++] = sym;
+	return sym;
+}
+
+void free_symbols() {
+	for(int i=0; i<SYMBOL_TABLE_SIZE; i++) {
+		while( symbols[i] != NULL ) {
+			struct symbol *next = symbols[i]->next;
+			free(symbols[i]->name);
+			free(symbols[i]);
+			symbols[i] = next;
+		}
+	}
+}
+
+long number() {
+	char num[17];
 	int i = 0;
 	int found = 0;
 	const int hex = 1;
 	const int bin = 2;
 	const int dec = 4;
 	int base;
+	long value;
 	
 	if( look == '$' ) {
 		base = hex;
@@ -175,6 +459,10 @@ unsigned short _operand() {
 	
 	while( is_digit(look) || is_alpha(look)) {
 		found = 1;
+		if( i >= 16 ) {
+			printf("Syntax error. Line: %d. Number too long.\n", line_no);
+			exit(1);
+		}
 		num[i++] = (char)look;
 		la();
 	}
@@ -187,482 +475,439 @@ unsigned short _operand() {
 	num[i] = '\0';
 		
 	if( base == hex )
-		operand = hex_to_decimal(num);
+		value = hex_to_decimal(num);
 	else if( base == dec )
-		operand = atoi(num);
-	else if( base == bin )
-		operand = bin_to_decimal(atoi(num));
+		value = atol(num);
+	else
+		value = bin_to_decimal(atoll(num));
+	return value;
+}
+
+// A number or a name, or the low (<) or high (>) byte of one
+long term() {
+	char name[MAX_NAME];
+	struct symbol *sym;
+	
+	skipWS();
+	last_label = 0;
+	term_label = 0;
+	term_external = NULL;
+	if( look == '<' || look == '>' ) {
+		int byte = look == '<' ? NANOOBJ_LOW : NANOOBJ_HIGH;
+		la();
+		long value = term();
+		if( term_label || term_external != NULL ) {
+			operand_byte = byte;
+			operand_address = value;
+		}
+		last_label = 0;
+		return byte == NANOOBJ_LOW ? value & 0xff : (value >> 8) & 0xff;
+	}
+	if( ! is_name_start(look) )
+		return number();
+	
+	read_name(name);
+	sym = find_symbol(name);
+	if( sym == NULL && pass != 1 && object_mode )
+		sym = add_external(name);
+	if( sym == NULL ) {
+		// Could be a label further down. The first pass doesn't need its value.
+		if( pass != 1 ) {
+			printf("Syntax error. Line: %d. '%s' is not defined.\n", line_no, name);
+			exit(1);
+		}
+		undefined = 1;
+		return 0;
+	}
+	last_label = sym->label;
+	term_label = sym->label;
+	if( sym->external )
+		term_external = sym;
+	return sym->value;
+}
+
+// Keep count of the labels and externals in an operand, to see if it needs relocating
+void count_relocatable(int sign) {
+	operand_labels += sign * term_label;
+	if( term_external != NULL ) {
+		operand_externals += sign;
+		operand_external = term_external;
+	}
+}
+
+unsigned short _operand() {
+	long value;
+	
+	int terms = 1;
+	
+	undefined = 0;
+	operand_labels = 0;
+	operand_externals = 0;
+	operand_byte = 0;
+	skipWS();
+	operand_text = src_pos - 1;
+	operand_low = look == '<';
+	value = term();
+	label_operand = last_label;
+	count_relocatable(1);
+	skipWS();
+	while( look == '+' || look == '-' ) {
+		label_operand = 0;
+		int op = look;
+		la();
+		if( op == '+' ) {
+			value += term();
+			count_relocatable(1);
+		} else {
+			value -= term();
+			count_relocatable(-1);
+		}
+		terms++;
+		skipWS();
+	}
+	if( operand_byte && terms > 1 && object_mode ) {
+		printf("Syntax error. Line: %d. In a module, < and > of an address can't be added to.\n", line_no);
+		exit(1);
+	}
+	if( operand_externals != 0 )
+		value &= 0xffff;			// The addend for nanold
+	operand_length = (look == EOF ? src_end : src_pos - 1) - operand_text;
 		
-	if( operand > 65535 ) {
-		printf("Syntax error. Line: %d. Number too large. An operand must lie in the range 0 to 65535.");
+	if( ! undefined && (value < 0 || value > 65535) ) {
+		printf("Syntax error. Line: %d. Operand out of range: %ld. An operand must lie in the range 0 to 65535.\n", line_no, value);
 		exit(1);
 	}
 	
+	operand = (unsigned short) value;
 	return operand;
 }	
 
+unsigned int hash(const char *name) {
+	unsigned int h = 0;
+	
+	while( *name )
+		h = h * 33 + toupper((unsigned char) *name++);
+	return (h * HASH_MULTIPLIER) >> 25;
+}
+
+void build_hash_table() {
+	for(int i=0; i<num_mnemonics; i++) {
+		unsigned int slot = hash(mnemonics[i].name);
+		while( hash_table[slot] != NULL )
+			slot = (slot + 1) % HASH_SIZE;
+		hash_table[slot] = &mnemonics[i];
+	}
+}
+
+struct mnemonic *find_mnemonic(const char *name) {
+	// The slots after a taken one hold mnemonics that hashed to it too
+	for(unsigned int slot = hash(name); hash_table[slot] != NULL; slot = (slot + 1) % HASH_SIZE) {
+		if( striccmp(name, hash_table[slot]->name) == 0 )
+			return hash_table[slot];
+	}
+	return NULL;
+}
+
+void unknown_mnemonic(const char *name) {
+	printf("Syntax error. Line: %d. Unknown assembler mnemonic '%s'. This error also occurs if you neglect to include an ORG directive in your source code. \n", line_no, name);
+	exit(1);
+}
+
 void mnemonic() {
-	int j = 0;
-	char cbuf[80];			// Temporary buffer
-	mindex = -1;
+	char cbuf[MAX_NAME];
 	
-	// Copy read buffer to temporary string buffer
-	while( is_alpha(look) ) {
-		cbuf[j++] = (char)look;
-		la();
-		if( j >= 80 ) {
-			printf("Syntax error. Line: %d. Menmomic too long.\n", line_no);
+	read_name(cbuf);
+	mn = find_mnemonic(cbuf);
+	if( mn == NULL )
+		unknown_mnemonic(cbuf);
+}
+
+
+// The operand at offset in the code uses a label or an external, so nanold has to fix it up
+void add_relocation(size_t offset) {
+	if( operand_labels == 0 && operand_externals == 0 )
+		return;
+	if( operand_labels < 0 || operand_labels > 1 || operand_externals < 0 || operand_externals > 1 ||
+			(operand_labels != 0 && operand_externals != 0) ) {
+		printf("Syntax error. Line: %d. An operand in a module can be one address, plus or minus a number, or the difference of two labels.\n", line_no);
+		exit(1);
+	}
+	if( operand_width[amode] == 1 && ! operand_byte ) {
+		printf("Syntax error. Line: %d. An address doesn't fit in a byte. Use < or > for its low or high byte.\n", line_no);
+		exit(1);
+	}
+	if( num_relocations == relocations_capacity ) {
+		relocations_capacity = relocations_capacity * 2 + 64;
+		relocations = realloc(relocations, relocations_capacity * sizeof(struct object_relocation));
+		if( relocations == NULL ) {
+			printf("Error: Out of memory.\n");
 			exit(1);
 		}
 	}
-	cbuf[j] = '\0';
-		
-	// Compare temporary buffer to token list
-	for(int i=0; i<num_tokens; i++) {
-		if( striccmp(cbuf, tokens[i]) == 0) {
-			mindex = i;
-			break;
+	struct object_relocation *r = &relocations[num_relocations++];
+	r->offset = offset;
+	r->symbol = operand_externals != 0 ? operand_external->index : NANOOBJ_MODULE;
+	r->addend = operand_byte ? (unsigned short) operand_address : operand;
+	r->type = operand_byte ? operand_byte : NANOOBJ_WORD;
+	r->size = operand_width[amode];
+}
+
+void add_instruction(int index, unsigned short address) {
+	if( code_size == code_capacity ) {
+		code_capacity = code_capacity * 2 + 256;
+		code_list = realloc(code_list, code_capacity * sizeof(struct instruction));
+		if( code_list == NULL ) {
+			printf("Error: Out of memory.\n");
+			exit(1);
 		}
 	}
+	struct instruction *in = &code_list[code_size++];
+	in->index = index;
+	in->opcode = mn->opcode[amode];
+	in->operand = operand;
+	in->address = address;
+	in->text = operand_width[amode] > 0 ? operand_text : NULL;
+	in->text_length = operand_width[amode] > 0 ? operand_length : 0;
+	in->target = label_here;
+	in->label_operand = operand_width[amode] > 0 && label_operand;
+}
+
+void no_mode() {
+	printf("Syntax error. Line: %d. %s doesn't have %s addressing.\n", line_no, mn->name, mode_names[amode]);
+	exit(1);
+}
+
+/* Read the operand and work out the addressing mode from what is around it: # for immediate,
+ * (address) for indirect, (address),Y for indirect indexed and address,X or address,Y for
+ * indexed. An operand that starts with <, like <$80 or <ptr, goes in the instruction's zero
+ * page form if it has one. Zero page is only used when it is asked for, so a source written
+ * for absolute addressing keeps its layout, and the first pass can size the instruction
+ * without knowing the address.
+ */
+void address_mode() {
+	skipWS();
+	if( look == '#' ) {
+		amode = mn->opcode[IMMEDIATE_WORD] != NONE ? IMMEDIATE_WORD : IMMEDIATE;
+		la();
+	} else if( look == '(' ) {
+		amode = INDIRECT;
+		la();
+	} else {
+		// Absolute, or implied if the instruction has no operand
+		amode = mn->opcode[ABSOLUTE] == NONE ? IMPLIED : ABSOLUTE;
+	}
+	if( mn->opcode[amode] == NONE && ! (amode == INDIRECT && mn->opcode[INDIRECT_Y] != NONE) )
+		no_mode();
+	if( amode == IMPLIED )
+		return;
 	
-	// If no match generate an error
-	if( mindex == -1 ) {
-		printf("Syntax error. Line: %d. Unknown assembler mnemonic '%s'. This error also occurs if you neglect to include an ORG directive in your source code. \n", line_no - 1, cbuf);
+	_operand();
+	skipWS();
+	if( amode == INDIRECT ) {
+		if( look != ')' ) {
+			printf("Syntax error. Line: %d. Expected closing parenthesis ')' Found '%c'.\n", line_no, look);
+			exit(1);
+		}
+		la();
+		skipWS();
+	}
+	if( look == ',' ) {
+		la();
+		skipWS();
+		int reg = toupper(look);
+		la();
+		if( (reg != 'X' && reg != 'Y') || is_name_start(look) || is_digit(look) ) {
+			printf("Syntax error. Line: %d. Expected X or Y after ','.\n", line_no);
+			exit(1);
+		}
+		if( amode == IMMEDIATE || amode == IMMEDIATE_WORD || (amode == INDIRECT && reg == 'X') ) {
+			printf("Syntax error. Line: %d. An %s operand can't be indexed with %c.\n", line_no, mode_names[amode], reg);
+			exit(1);
+		}
+		amode = amode == INDIRECT ? INDIRECT_Y : reg == 'X' ? ABSOLUTE_X : ABSOLUTE_Y;
+	}
+	if( amode == ABSOLUTE && mn->opcode[ZERO_PAGE] != NONE && operand_low )
+		amode = ZERO_PAGE;
+	if( mn->opcode[amode] == NONE )
+		no_mode();
+	if( operand_width[amode] == 1 && operand > 255 ) {
+		printf("Syntax error. Line: %d. Operand too large: $%x (%d).\n", line_no, operand, operand);
 		exit(1);
 	}
 }
 
-
 void code() {
-	char buf[2];
+	unsigned char buf[3];
+	int size;
+	size_t start = obj_size;		// Where the instruction goes in the output
+	int start_line = line_no;
 	
-	mnemonic();
-	address_mode(); // Get the address mode
-
-	// Decode instruction index and write instruction + operand
-	switch(mindex) {
-		case 0: 
-			if( amode == 0 ) {
-				instruction = LDA_ABS;
-				_operand(); 
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = LDA_IMM;
-				_operand();
-				if( operand > 255 ) {
-					printf("Syntax error. Line: %d. Operand too large: $%x (%d).\n", line_no, operand, operand);
-					exit(1);
-				}
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-				
-			break; // LDA
-		case 1: 
-			instruction = STA;
-			_operand(); //printf("Operand: %d\n", operand);
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			buf[0] = (unsigned char) (operand >> 8); 
-			buf[1] = (unsigned char) (operand & 0xff);
-			//printf("Hi: %d, Lo: %d\n", buf[0], buf[1]);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // STA
-		case 2: 
-			if( amode == 0 ) {
-				instruction = ADD_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = ADD_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // ADD
-		case 3: 
-			if( amode == 0 ) {
-				instruction = SUB_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = SUB_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // SUB
-		case 4: 
-			if( amode == 0 ) {
-				instruction = MUL_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = MUL_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // MUL
-		case 5: 
-			if( amode == 0 ) {
-				instruction = DIV_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = DIV_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // DIV
-		case 6: 
-			if( amode == 0 ) {
-				instruction = JMP; 
-				fwrite(&instruction, sizeof(instruction), 1, ofp); 
-				_operand();
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else if( amode == 2 ) {
-				instruction = JMP_IND; 
-				fwrite(&instruction, sizeof(instruction), 1, ofp); 
-				_operand();
-				//printf("look='%c' operand=%x\n", look, operand);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-				skipWS();
-				if( look != ')' ) {
-					printf("Syntax error. Line: %d. Expected closing parenthesis ')' Found '%c'.\n", line_no, look);
-					exit(1);
-				}
-				la();
-			}
-			break; // JMP
-		case 7: 
-			instruction = JEQ; 
-			fwrite(&instruction, sizeof(instruction), 1, ofp); 
-			_operand();
-			buf[0] = (unsigned char) (operand >> 8);
-			buf[1] = (unsigned char) (operand & 0xff);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // JEQ
-		case 8: 
-			instruction = JNE; 
-			fwrite(&instruction, sizeof(instruction), 1, ofp); 
-			_operand();
-			buf[0] = (unsigned char) (operand >> 8);
-			buf[1] = (unsigned char) (operand & 0xff);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // JNE
-		case 9: instruction = HALT; fwrite(&instruction, sizeof(instruction), 1, ofp); HALT; break; // HALT
-		case 10: instruction = IN; fwrite(&instruction, sizeof(instruction), 1, ofp); break; // IN
-		case 11: instruction = OUT; fwrite(&instruction, sizeof(instruction), 1, ofp); break; // OUT
-		case 13:
-			instruction = JSR;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			_operand();
-			buf[0] = (unsigned char) (operand >> 8);
-			buf[1] = (unsigned char) (operand & 0xff);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // JSR
-		case 14:
-			instruction = RTS;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // RTS
-		case 15:
-			if( amode == 0 ) {
-				instruction = CMP_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = CMP_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // CMP
-		case 16:
-			instruction = PUSHA;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 17:
-			instruction = POPA;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 18:
-			instruction = SHL;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 19:
-			instruction = SHR;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 20:
-			instruction = INC;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 21:
-			instruction = DEC;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 22:
-			instruction = NOP;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break;
-		case 23:
-			if( amode == 0 ) {
-				instruction = LDX_ABS;
-				_operand(); 
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = LDX_IMM;
-				_operand();
-				if( operand > 255 ) {
-					printf("Syntax error. Line: %d. Operand too large: $%x (%d).\n", line_no, operand, operand);
-					exit(1);
-				}
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // LDX
-		case 24:
-			if( amode == 0 ) {
-				instruction = LDY_ABS;
-				_operand(); 
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = LDY_IMM;
-				_operand();
-				if( operand > 255 ) {
-					printf("Syntax error. Line: %d. Operand too large: $%x (%d).\n", line_no, operand, operand);
-					exit(1);
-				}
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // LDY
-		case 25: 
-			instruction = STX;
-			_operand(); //printf("Operand: %d\n", operand);
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			buf[0] = (unsigned char) (operand >> 8); 
-			buf[1] = (unsigned char) (operand & 0xff);
-			//printf("Hi: %d, Lo: %d\n", buf[0], buf[1]);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // STX
-		case 26: 
-			instruction = STY;
-			_operand(); //printf("Operand: %d\n", operand);
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			buf[0] = (unsigned char) (operand >> 8); 
-			buf[1] = (unsigned char) (operand & 0xff);
-			//printf("Hi: %d, Lo: %d\n", buf[0], buf[1]);
-			fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			break; // STY
-		case 27:
-			if( amode == 0 ) {
-				instruction = CPX_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = CPX_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // CPX
-		case 28:
-			if( amode == 0 ) {
-				instruction = CPY_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = CPY_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // CPY
-			// {"TAX"}, {"TAY"}, {"TXA"}, {"TYA"}
-		case 29:
-			instruction = TAX;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // TAX
-		case 30:
-			instruction = TAY;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // TAY
-		case 31:
-			instruction = TXA;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // TXA
-		case 32:
-			instruction = TYA;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // TYA	
-		case 33:
-			instruction = INX;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // INX	
-		case 34:
-			instruction = INY;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // INY
-		case 35:
-			instruction = DEX;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // DEX
-		case 36:
-			instruction = DEY;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // DEY
-		case 37:
-			instruction = NEG;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // NEG
-		case 38:
-			instruction = DUP;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // DUP
-		case 39:
-			instruction = SWAP;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // SWAP
-		case 40: 
-			if( amode == 0 ) {
-				instruction = AND_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = AND_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // AND
-		case 41: 
-			if( amode == 0 ) {
-				instruction = OR_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = OR_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // OR
-		case 42: 
-			if( amode == 0 ) {
-				instruction = XOR_ABS;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				buf[0] = (unsigned char) (operand >> 8);
-				buf[1] = (unsigned char) (operand & 0xff);
-				fwrite(&buf, sizeof(unsigned char), 2, ofp);
-			} else {
-				instruction = XOR_IMM;
-				_operand();
-				fwrite(&instruction, sizeof(instruction), 1, ofp);
-				fwrite(&operand, sizeof(unsigned char), 1, ofp);
-			}
-			break; // XOR
-		case 43:
-			instruction = NOT;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // NOT
-		case 44:
-			instruction = CLC;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // CLC
-		case 45:
-			instruction = SEC;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // SEC
-		case 46:
-			instruction = JCS;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // JCS
-		case 47:
-			instruction = JCC;
-			fwrite(&instruction, sizeof(instruction), 1, ofp);
-			break; // JCC
-		default:
-			printf("Internal error. Unhandled instruction index: %d.", mindex);
-			exit(1);
-			break;
+	if( mn->opcode[IMPLIED] == NONE && mn->opcode[ABSOLUTE] == NONE && mn->opcode[IMMEDIATE] == NONE ) {
+		printf("Syntax error. Line: %d. %s can only appear as the first line of code.\n", line_no, mn->name);
+		exit(1);
+	}
+	
+	address_mode(); // Get the address mode, and the operand if there is one
+	
+	// The optimiser can take it out, or put something else in its place
+	int index = num_instructions++;
+	if( rewrites != NULL && rewrites[index].action == REPLACE ) {
+		mn = rewrites[index].mn;
+		amode = rewrites[index].amode;
 	}
+	if( rewrites == NULL || rewrites[index].action != DELETE ) {
+		// Write the opcode, then the operand, big-endian
+		buf[0] = instruction = mn->opcode[amode];
+		size = 1 + operand_width[amode];
+		if( operand_width[amode] == 1 )
+			buf[1] = (unsigned char) operand;
+		else if( operand_width[amode] == 2 ) {
+			buf[1] = (unsigned char) (operand >> 8);
+			buf[2] = (unsigned char) (operand & 0xff);
+		}
+		if( object_mode && pass == 2 && operand_width[amode] > 0 )
+			add_relocation(start + 1);
+		if( optimise && pass == 2 )
+			add_instruction(index, (unsigned short) (org_address + start - header_size));
+		label_here = 0;
+		emit(buf, size);
+	}
+	
+	// Debug map: the address of every instruction and the line it came from
+	if( mfp != NULL && obj_size > start )
+		fprintf(mfp, "%04x %d\n", (unsigned short) (org_address + start - header_size), start_line);
 	skipWS();
 	comment();	
 }	
 
 
+// name EQU operand
+void equ(const char *name) {
+	_operand();
+	if( undefined ) {
+		printf("Syntax error. Line: %d. %s EQU uses a name that isn't defined above it.\n", line_no, name);
+		exit(1);
+	}
+	if( object_mode && (operand_labels != 0 || operand_externals != 0) ) {
+		printf("Syntax error. Line: %d. In a module, %s EQU can't use an address.\n", line_no, name);
+		exit(1);
+	}
+	define_symbol(name, operand, 0);
+	skipWS();
+	comment();
+}
+
+// GLOBAL name: other modules can use it
+void global() {
+	char name[MAX_NAME];
+	struct symbol *sym;
+	
+	skipWS();
+	if( ! is_name_start(look) ) {
+		printf("Syntax error. Line: %d. Expected a name after GLOBAL.\n", line_no);
+		exit(1);
+	}
+	read_name(name);
+	if( pass == 2 ) {
+		sym = find_symbol(name);
+		if( sym == NULL || sym->external ) {
+			printf("Syntax error. Line: %d. GLOBAL %s: %s isn't defined.\n", line_no, name, name);
+			exit(1);
+		}
+		sym->global = 1;
+	}
+	skipWS();
+	comment();
+}
+
+// An instruction, an EQU or a GLOBAL
+void statement(const char *name) {
+	char word[MAX_NAME];
+	
+	mn = find_mnemonic(name);
+	if( mn != NULL ) {
+		code();
+		return;
+	}
+	if( striccmp(name, "GLOBAL") == 0 ) {
+		global();
+		return;
+	}
+	skipWS();
+	read_name(word);
+	if( striccmp(word, "EQU") != 0 )
+		unknown_mnemonic(name);
+	if( find_mnemonic(name) != NULL ) {
+		printf("Syntax error. Line: %d. %s is a mnemonic and can't be used as a name.\n", line_no, name);
+		exit(1);
+	}
+	equ(name);
+}
+
 void line() {
+	char name[MAX_NAME];
+	
 	skipWS();
 	if( look == ';' ) {
 		comment();
-	} else if(is_alpha(look) ) {
-		code();
+		return;
+	}
+	if( look == '\r' || look == '\n' || look == EOF )
+		return;
+	if( ! is_name_start(look) ) {
+		printf("Syntax error. Line: %d. Unexpected '%c'.\n", line_no, look);
+		exit(1);
+	}
+	read_name(name);
+	if( look == ':' ) {
+		// A label. The rest of the line can be a statement too.
+		la();
+		if( find_mnemonic(name) != NULL ) {
+			printf("Syntax error. Line: %d. %s is a mnemonic and can't be used as a label.\n", line_no, name);
+			exit(1);
+		}
+		define_symbol(name, (unsigned short) (org_address + obj_size - header_size), 1);
+		label_here = 1;
+		skipWS();
+		if( look == ';' ) {
+			comment();
+			return;
+		}
+		if( ! is_name_start(look) )
+			return;
+		read_name(name);
 	}
+	statement(name);
 }
 
 void org() {
 	char buf[2];
 	
 	mnemonic();
-	if( mindex != 12 ) {
+	if( strcmp(mn->name, "ORG") != 0 ) {
 		printf("Syntax error. Missing ORG directive at start of code. The ORG directive must appear as the first line in your assembly soure code file.\n");
 		exit(1);
 	}
 	_operand();
-	if( operand <= 0xff ) {
-		printf("Warning: Program originates in an area of memory used by the system. Addresses $0x00 to $0xFF are reserved for system use.\n");
+	if( undefined ) {
+		printf("Syntax error. ORG can only use names defined above it.\n");
+		exit(1);
 	}
-	fwrite(&operand, sizeof(unsigned short), 1, ofp);
+	if( pass == 1 && operand <= 0xff && ! warned ) {
+		warned = 1;
+		warn_system_memory();
+	}
+	emit(&operand, sizeof(unsigned short));
+	org_address = operand;
 }
 
 void assemble() {
-	skipWS();
-	org();
-	skipWS();
-	comment();
+	if( ! object_mode ) {
+		skipWS();
+		org();
+		skipWS();
+		comment();
+	}
 	skipWS();
 	
 	while( look != EOF ) {
@@ -674,35 +919,644 @@ void assemble() {
 	}	
 }	
 
-int main(int argc, char* argv[]) {
-	if( argc != 3 ) {
-		printf("%s\n", ASM_VERSION);
-		printf("\n\tusage: nanoasm <source file> <out file>  e.g., nanoasm hello.asm hello.bin");
-		exit(1);
+/* Peephole optimiser rules. Every one leaves the registers, flags and memory just as they were,
+ * on every path through the code:
+ *
+ * - A jump or branch to the next instruction goes.
+ * - NOP goes.
+ * - LDA, LDAW #, TXA or TYA followed by another of them: the first goes, the second overwrites A and Z.
+ * - LDA n / STA n, and the same for X and Y: the store goes, memory already holds the value.
+ * - STA n / STA n: the second store goes.
+ * - TXA / TAX and TYA / TAY: the second transfer goes.
+ * - TAX / TXA and TAY / TYA: the second transfer goes when Z already reflects A.
+ * - STA n / LDA n: the load goes when A is known to be under 256 and Z already reflects it.
+ * - With the carry known to be clear, ADD #1 becomes INC, ADDW #1 becomes INCW and LDA #0 / ADD x
+ *   becomes LDA x.
+ * - CLC or SEC goes when the carry already has that value, or is set again before anything reads it.
+ *
+ * n is an absolute or zero page address. Indexed and indirect indexed operands are left alone.
+ *
+ * Facts about A and the flags are only carried forward through straight line code. A label or a
+ * JSR forgets them. SUB #1 is not replaced with DEC: SUB with the carry set adds 255 to A rather
+ * than subtracting 1, so it differs in the high byte of A and the carry, and SUBW #1 is not replaced
+ * with DECW for the same reason. LDAW n is not taken out, as it faults on $ffff. PUSHA / POPA is not
+ * removed either: it truncates A to a byte, can overflow the stack, and leaves the byte in stack
+ * memory.
+ *
+ * This is only safe for code that is reached through labels and doesn't modify itself. Don't
+ * use -O on a program that jumps to numeric addresses or writes into its own instructions.
+ */
+#define UNKNOWN 2
+
+// How instructions touch the carry flag
+int reads_carry(unsigned char op) {
+	return op == ADD_IMM || op == ADD_ABS || op == SUB_IMM || op == SUB_ABS || op == JCS || op == JCC ||
+		op == SHR || op == ADD_ZP || op == ADD_ABS_X || op == ADD_ABS_Y || op == ADD_IND_Y || op == SUB_ZP ||
+		op == SUB_ABS_X || op == SUB_ABS_Y || op == SUB_IND_Y || op == ADDW_IMM || op == ADDW_ABS || op == SUBW_IMM ||
+		op == SUBW_ABS;
+}
+
+int writes_carry(unsigned char op) {
+	return op == CLC || op == SEC || op == MUL_IMM || op == MUL_ABS || op == INC || op == DEC || op == SHL ||
+		op == MEMCMP || op == CMPW_IMM || op == CMPW_ABS || op == INCW || op == DECW;
+}
+
+// Instructions after which the next one needn't run
+int leaves_block(unsigned char op) {
+	return op == JMP || op == JMP_IND || op == JSR || op == RTS || op == HALT;
+}
+
+int is_branch(unsigned char op) {
+	return op == JMP || op == JEQ || op == JNE || op == JCS || op == JCC;
+}
+
+// A register load that only sets A and Z, from something other than A
+int loads_acc(unsigned char op) {
+	return op == LDA_IMM || op == LDA_ABS || op == TXA || op == TYA || op == LDA_ZP || op == LDA_ABS_X ||
+		op == LDA_ABS_Y || op == LDA_IND_Y || op == LDAW_IMM;
+}
+
+int same_operand(struct instruction *a, struct instruction *b) {
+	return a->operand == b->operand && a->text_length == b->text_length &&
+		memcmp(a->text, b->text, a->text_length) == 0;
+}
+
+// Is the carry set again before anything reads it, in the code after code_list[i]?
+int carry_dead(int i) {
+	for(int j=i+1; j<code_size; j++) {
+		unsigned char op = code_list[j].opcode;
+		if( code_list[j].target || reads_carry(op) )
+			return 0;
+		if( writes_carry(op) )
+			return 1;
+		if( leaves_block(op) || is_branch(op) )
+			return 0;
 	}
+	return 0;
+}
+
+void set_rewrite(struct instruction *in, int action, char *name, unsigned char mode) {
+	rewrites[in->index].action = action;
+	rewrites[in->index].mn = action == REPLACE ? find_mnemonic(name) : NULL;
+	rewrites[in->index].amode = mode;
+}
+
+// One pass of the rules over code_list[]. Returns how many it applied.
+int peephole(void) {
+	int carry = UNKNOWN;			// 0, 1 or UNKNOWN
+	int acc_byte = 0;				// A is under 256
+	int z_acc = 0;					// Z says whether the low byte of A is zero
+	int changes = 0;
+	
+	if( rewrites == NULL )
+		rewrites = calloc(num_instructions, sizeof(struct rewrite));
+	
+	for(int i=0; i<code_size; i++) {
+		struct instruction *in = &code_list[i];
+		struct instruction *next = i + 1 < code_size && ! code_list[i + 1].target ? &code_list[i + 1] : NULL;
+		unsigned char op = in->opcode;
+		
+		if( in->target ) {
+			carry = UNKNOWN;
+			acc_byte = 0;
+			z_acc = 0;
+		}
+		
+		// Rules that take the instruction out, or the one after it
+		if( is_branch(op) && in->label_operand && in->operand == in->address + 3 ) {
+			set_rewrite(in, DELETE, NULL, 0);
+			changes++;
+			continue;
+		}
+		if( op == NOP || (op == CLC && carry == 0) || (op == SEC && carry == 1) ||
+				((op == CLC || op == SEC) && carry_dead(i)) ) {
+			set_rewrite(in, DELETE, NULL, 0);
+			changes++;
+			continue;
+		}
+		if( loads_acc(op) && i + 1 < code_size && loads_acc(code_list[i + 1].opcode) ) {
+			set_rewrite(in, DELETE, NULL, 0);
+			changes++;
+			continue;
+		}
+		if( next != NULL && (
+				(op == LDA_ABS && next->opcode == STA && same_operand(in, next)) ||
+				(op == LDX_ABS && next->opcode == STX && same_operand(in, next)) ||
+				(op == LDY_ABS && next->opcode == STY && same_operand(in, next)) ||
+				(op == LDA_ZP && next->opcode == STA_ZP && same_operand(in, next)) ||
+				(op == LDX_ZP && next->opcode == STX_ZP && same_operand(in, next)) ||
+				(op == LDY_ZP && next->opcode == STY_ZP && same_operand(in, next)) ||
+				((op == STA || op == STX || op == STY || op == STA_ZP || op == STX_ZP || op == STY_ZP) &&
+					next->opcode == op && same_operand(in, next)) ||
+				(op == TXA && next->opcode == TAX) || (op == TYA && next->opcode == TAY) ||
+				(op == TAX && next->opcode == TXA && z_acc) || (op == TAY && next->opcode == TYA && z_acc) ||
+				(op == STA && next->opcode == LDA_ABS && same_operand(in, next) && acc_byte && z_acc) ||
+				(op == STA_ZP && next->opcode == LDA_ZP && same_operand(in, next) && acc_byte && z_acc)) ) {
+			set_rewrite(next, DELETE, NULL, 0);
+			changes++;
+			i++;
+		} else if( carry == 0 && op == ADD_IMM && in->operand == 1 ) {
+			set_rewrite(in, REPLACE, "INC", IMPLIED);
+			changes++;
+		} else if( carry == 0 && op == ADDW_IMM && in->operand == 1 ) {
+			set_rewrite(in, REPLACE, "INCW", IMPLIED);
+			changes++;
+		} else if( carry == 0 && op == LDA_IMM && in->operand == 0 && next != NULL &&
+				(next->opcode == ADD_IMM || next->opcode == ADD_ABS || next->opcode == ADD_ZP) ) {
+			set_rewrite(in, DELETE, NULL, 0);
+			set_rewrite(next, REPLACE, "LDA", next->opcode == ADD_IMM ? IMMEDIATE : next->opcode == ADD_ZP ? ZERO_PAGE : ABSOLUTE);
+			changes++;
+			i++;
+			acc_byte = 1;
+			z_acc = 1;
+			continue;
+		}
 		
-	fp = fopen(argv[1], "r");
+		// What we know after it
+		switch( op ) {
+			case CLC: carry = 0; break;
+			case SEC: carry = 1; break;
+			case LDA_IMM: case LDA_ABS: case POPA: case AND_IMM: case AND_ABS:
+			case LDA_ZP: case LDA_ABS_X: case LDA_ABS_Y: case LDA_IND_Y:
+			case AND_ZP: case AND_ABS_X: case AND_ABS_Y: case AND_IND_Y:
+				acc_byte = 1;
+				z_acc = 1;
+				break;
+			case OR_IMM: case OR_ABS: case XOR_IMM: case XOR_ABS: case DIV_IMM: case DIV_ABS: case SHR:
+			case OR_ZP: case OR_ABS_X: case OR_ABS_Y: case OR_IND_Y:
+			case XOR_ZP: case XOR_ABS_X: case XOR_ABS_Y: case XOR_IND_Y:
+				z_acc = 1;
+				break;
+			case ADD_IMM: case ADD_ABS: case SUB_IMM: case SUB_ABS: case MUL_IMM: case MUL_ABS:
+			case INC: case DEC: case SHL: case TXA: case TYA: case NOT:
+			case ADD_ZP: case ADD_ABS_X: case ADD_ABS_Y: case ADD_IND_Y:
+			case SUB_ZP: case SUB_ABS_X: case SUB_ABS_Y: case SUB_IND_Y:
+				acc_byte = 0;
+				z_acc = 1;
+				break;
+			case NEG: case IN: case LDAW_IMM: case LDAW_ABS: case ADDW_IMM: case ADDW_ABS:
+			case SUBW_IMM: case SUBW_ABS: case INCW: case DECW:
+				acc_byte = 0;
+				z_acc = 0;
+				break;
+			case LDX_IMM: case LDX_ABS: case LDY_IMM: case LDY_ABS: case CMP_IMM: case CMP_ABS:
+			case CPX_IMM: case CPX_ABS: case CPY_IMM: case CPY_ABS: case INX: case INY: case DEX: case DEY:
+			case MEMCMP: case CMPW_IMM: case CMPW_ABS: case LDX_ZP: case LDY_ZP: case CMP_ZP: case CMP_ABS_X: case CMP_ABS_Y: case CMP_IND_Y:
+				z_acc = 0;
+				break;
+		}
+		if( writes_carry(op) && op != CLC && op != SEC )
+			carry = UNKNOWN;
+		if( reads_carry(op) && ! is_branch(op) )
+			carry = UNKNOWN;
+		if( leaves_block(op) ) {
+			carry = UNKNOWN;
+			acc_byte = 0;
+			z_acc = 0;
+		}
+	}
+	return changes;
+}
+
+// Write the module's code, symbols and relocations in nanold's object file format
+void write_object(FILE *ofp) {
+	struct object_header header;
+	struct object_symbol *syms = malloc((num_externs + 1) * sizeof(struct object_symbol));
+	int num_syms = 0;
+	char *names;
+	size_t names_size;
+	FILE *names_fp = open_memstream(&names, &names_size);
+	
+	// Externals first, so their place in the list is the index the relocations use
+	for(int i=0; i<num_externs; i++) {
+		syms[num_syms].name = ftell(names_fp);
+		syms[num_syms].value = 0;
+		syms[num_syms++].type = NANOOBJ_EXTERN;
+		fwrite(externs[i]->name, 1, strlen(externs[i]->name) + 1, names_fp);
+	}
+	for(int h=0; h<SYMBOL_TABLE_SIZE; h++) {
+		for(struct symbol *sym = symbols[h]; sym != NULL; sym = sym->next) {
+			if( ! sym->global )
+				continue;
+			syms = realloc(syms, (num_syms + 1) * sizeof(struct object_symbol));
+			syms[num_syms].name = ftell(names_fp);
+			syms[num_syms].value = sym->value;
+			syms[num_syms++].type = sym->label ? NANOOBJ_LABEL : NANOOBJ_CONSTANT;
+			fwrite(sym->name, 1, strlen(sym->name) + 1, names_fp);
+		}
+	}
+	fclose(names_fp);
+	
+	memset(&header, 0, sizeof(header));
+	header.magic = NANOOBJ_MAGIC;
+	header.code_size = obj_size;
+	header.num_symbols = num_syms;
+	header.num_relocations = num_relocations;
+	header.names_size = names_size;
+	fwrite(&header, sizeof(header), 1, ofp);
+	fwrite(obj, 1, obj_size, ofp);
+	fwrite(syms, sizeof(struct object_symbol), num_syms, ofp);
+	fwrite(relocations, sizeof(struct object_relocation), num_relocations, ofp);
+	fwrite(names, 1, names_size, ofp);
+	free(syms);
+	free(names);
+}
+
+/* The assembly cache (--cache-dir). An output is filed under a hash of the source, the assembler
+ * version and the options that change what it writes. Assembling the same thing again links the
+ * cached file in place of the output, or copies it, without parsing the source at all. What the
+ * assembler had to say about it, a warning or the optimiser's report, is kept in a .notes file
+ * beside it and said again. The cache directory also keeps a count of hits and misses in its
+ * stats file.
+ */
+char *cache_dir;
+
+// 64-bit FNV-1a
+unsigned long long fnv1a(unsigned long long h, const void *data, size_t size) {
+	const unsigned char *p = data;
+	
+	for(size_t i=0; i<size; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+// The file the output would be cached in. The size goes in the name too, to make a clash less likely.
+char *cache_name(const char *source, int debug_map) {
+	char options[8];
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	char *name = malloc(strlen(cache_dir) + 64);
+	
+	sprintf(options, "%c%c%c", optimise ? 'O' : '-', object_mode ? 'c' : '-', debug_map ? 'g' : '-');
+	h = fnv1a(h, ASM_VERSION, strlen(ASM_VERSION) + 1);
+	h = fnv1a(h, options, strlen(options) + 1);
+	if( debug_map )
+		h = fnv1a(h, source, strlen(source) + 1);		// The map names the source file
+	h = fnv1a(h, src, src_end - src);
+	sprintf(name, "%s/%016llx-%lx", cache_dir, h, (unsigned long) (src_end - src));
+	return name;
+}
+
+// Hard link from to to, or copy it if they are on different file systems
+int link_or_copy(const char *from, const char *to) {
+	char buf[65536];
+	size_t n;
+	
+	if( link(from, to) == 0 )
+		return 0;
+	FILE *in = fopen(from, "rb");
+	if( in == NULL )
+		return -1;
+	FILE *out = fopen(to, "wb");
+	if( out == NULL ) {
+		fclose(in);
+		return -1;
+	}
+	while( (n = fread(buf, 1, sizeof(buf), in)) > 0 )
+		fwrite(buf, 1, n, out);
+	fclose(in);
+	return ferror(out) | fclose(out);
+}
+
+// Put a file in the cache. It goes in under a temporary name first, so nobody sees half of it.
+void cache_store(const char *file, const char *name) {
+	char *tmp = malloc(strlen(name) + 32);
+	
+	sprintf(tmp, "%s.%d.tmp", name, (int) getpid());
+	unlink(tmp);
+	if( link_or_copy(file, tmp) == 0 )
+		rename(tmp, name);
+	unlink(tmp);
+	free(tmp);
+}
+
+// Keep the warnings and the optimiser's savings, for a hit to report
+void cache_store_notes(const char *name, unsigned long saved_bytes, int saved_instructions) {
+	char *tmp = malloc(strlen(name) + 32);
+	
+	sprintf(tmp, "%s.%d.tmp", name, (int) getpid());
+	FILE *fp = fopen(tmp, "w");
+	if( fp != NULL ) {
+		fprintf(fp, "warned %d saved %lu %d\n", warned, saved_bytes, saved_instructions);
+		if( fclose(fp) == 0 )
+			rename(tmp, name);
+	}
+	unlink(tmp);
+	free(tmp);
+}
+
+// Say what the assembler said when the cached file was made. Returns -1 if the notes can't be read.
+int cache_replay_notes(const char *name, const char *source) {
+	unsigned long saved_bytes;
+	int cached_warned, saved_instructions;
+	
+	FILE *fp = fopen(name, "r");
+	if( fp == NULL )
+		return -1;
+	int n = fscanf(fp, "warned %d saved %lu %d", &cached_warned, &saved_bytes, &saved_instructions);
+	fclose(fp);
+	if( n != 3 )
+		return -1;
+	if( cached_warned )
+		warn_system_memory();
+	if( optimise )
+		report_optimiser(source, saved_bytes, saved_instructions);
+	return 0;
+}
+
+// Count a hit or a miss in the stats file
+void cache_count(int hit) {
+	char *name = malloc(strlen(cache_dir) + 8);
+	unsigned long hits = 0, misses = 0;
+	
+	sprintf(name, "%s/stats", cache_dir);
+	int fd = open(name, O_RDWR | O_CREAT, 0666);
+	free(name);
+	if( fd < 0 )
+		return;
+	flock(fd, LOCK_EX);
+	FILE *fp = fdopen(fd, "r+");
+	if( fscanf(fp, "hits %lu misses %lu", &hits, &misses) != 2 )
+		hits = misses = 0;
+	if( hit )
+		hits++;
+	else
+		misses++;
+	rewind(fp);
+	fprintf(fp, "hits %lu misses %lu\n", hits, misses);
+	fclose(fp);
+}
+
+void cache_stats() {
+	char *name = malloc(strlen(cache_dir) + 8);
+	unsigned long hits = 0, misses = 0, entries = 0, bytes = 0;
+	struct stat st;
+	
+	sprintf(name, "%s/stats", cache_dir);
+	FILE *fp = fopen(name, "r");
+	if( fp != NULL ) {
+		if( fscanf(fp, "hits %lu misses %lu", &hits, &misses) != 2 )
+			hits = misses = 0;
+		fclose(fp);
+	}
+	DIR *dir = opendir(cache_dir);
+	struct dirent *de;
+	while( dir != NULL && (de = readdir(dir)) != NULL ) {
+		char *path = malloc(strlen(cache_dir) + strlen(de->d_name) + 2);
+		sprintf(path, "%s/%s", cache_dir, de->d_name);
+		if( de->d_name[0] != '.' && strcmp(de->d_name, "stats") != 0 && strstr(de->d_name, ".map") == NULL && strstr(de->d_name, ".notes") == NULL &&
+				stat(path, &st) == 0 && S_ISREG(st.st_mode) ) {
+			entries++;
+			bytes += st.st_size;
+		}
+		free(path);
+	}
+	if( dir != NULL )
+		closedir(dir);
+	printf("Cache %s: %lu hits, %lu misses", cache_dir, hits, misses);
+	if( hits + misses > 0 )
+		printf(" (%.0f%% hits)", hits * 100.0 / (hits + misses));
+	printf(", %lu entries, %lu bytes.\n", entries, bytes);
+	free(name);
+}
+
+// Assemble source into out, an image, or with -c an object file. Returns 0, or exits on an error.
+int assemble_file(const char *source, const char *out, int debug_map) {
+	FILE *fp = fopen(source, "rb");
 	if( ! fp) {
-		printf("Error: Can't open file %s for reading.\n", argv[1]);
+		printf("Error: Can't open file %s for reading.\n", source);
 		exit(1);
 	}
+	fseek(fp, 0, SEEK_END);
+	long src_size = ftell(fp);
+	rewind(fp);
+	src = malloc(src_size + 1);
+	if( src == NULL || fread(src, 1, src_size, fp) != (size_t) src_size ) {
+		printf("Error: Can't read file %s.\n", source);
+		exit(1);
+	}
+	fclose(fp);
+	src_pos = src;
+	src_end = src + src_size;
+	
+	// The output, or a file another process is still using, is replaced rather than written over.
+	// It could be a link to a file in the cache.
+	char *map_name = malloc(strlen(out) + 5);
+	sprintf(map_name, "%s.map", out);
+	char *cached = NULL, *cached_map = NULL, *cached_notes = NULL;
+	if( cache_dir != NULL ) {
+		cached = cache_name(source, debug_map);
+		cached_map = malloc(strlen(cached) + 5);
+		sprintf(cached_map, "%s.map", cached);
+		cached_notes = malloc(strlen(cached) + 7);
+		sprintf(cached_notes, "%s.notes", cached);
+		if( access(cached, R_OK) == 0 && access(cached_notes, R_OK) == 0 && (! debug_map || access(cached_map, R_OK) == 0) ) {
+			unlink(out);
+			if( link_or_copy(cached, out) == 0 ) {
+				if( debug_map ) {
+					unlink(map_name);
+					link_or_copy(cached_map, map_name);
+				}
+				if( cache_replay_notes(cached_notes, source) == 0 ) {
+					cache_count(1);
+					return 0;
+				}
+			}
+		}
+	}
+	
+	build_hash_table();
+	if( object_mode )
+		header_size = 0;
+	size_t first_size = 0;
+	int first_count = 0;
+	for(int rounds = 1; ; rounds++) {
+		for(pass = 1; pass <= 2; pass++) {
+			if( pass == 2 && debug_map ) {
+				if( mfp != NULL ) {
+					fclose(mfp);
+					free(map_text);
+				}
+				mfp = open_memstream(&map_text, &map_size);
+				fprintf(mfp, "source %s\n", source);
+			}
+			src_pos = src;
+			obj_size = 0;
+			code_size = 0;
+			num_instructions = 0;
+			num_externs = 0;
+			num_relocations = 0;
+			label_here = 0;
+			line_no = 1;
+			look = 0;
+			la();
+	
+			// Write magic number
+			unsigned short magic = 0xd00d;
+			if( ! object_mode )
+				emit(&magic, sizeof(magic));
+
+			assemble();
+		}
+		if( rounds == 1 ) {
+			first_size = obj_size;
+			first_count = code_size;
+		}
+		if( ! optimise || rounds == MAX_ROUNDS || peephole() == 0 )
+			break;
+		free_symbols();
+	}
+	if( optimise )
+		report_optimiser(source, first_size - obj_size, first_count - code_size);
 	
-	ofp = fopen(argv[2], "wb");
+	// Only now that it has all assembled, write the files, so a syntax error leaves nothing behind
+	unlink(out);
+	FILE *ofp = fopen(out, "wb");
 	if( ! ofp) {
-		printf("Error: Can't open file %s for writing.\n", argv[2]);
+		printf("Error: Can't open file %s for writing.\n", out);
 		exit(1);
 	}
+	if( object_mode )
+		write_object(ofp);
+	else
+		fwrite(obj, 1, obj_size, ofp);
+	if( ferror(ofp) || fclose(ofp) != 0 ) {
+		printf("Error: Can't write file %s.\n", out);
+		exit(1);
+	}
+	if( mfp != NULL ) {
+		fclose(mfp);
+		unlink(map_name);
+		FILE *map_fp = fopen(map_name, "w");
+		if( ! map_fp ) {
+			printf("Error: Can't open file %s for writing.\n", map_name);
+			exit(1);
+		}
+		fwrite(map_text, 1, map_size, map_fp);
+		fclose(map_fp);
+	}
+	if( cache_dir != NULL ) {
+		// The output goes in last, so a hit always finds the rest there with it
+		cache_store_notes(cached_notes, first_size - obj_size, first_count - code_size);
+		if( debug_map )
+			cache_store(map_name, cached_map);
+		cache_store(out, cached);
+		cache_count(0);
+	}
+	return 0;
+}
+
+// The object file for a source file: name.s becomes name.o
+char *object_name(const char *source) {
+	size_t len = strlen(source);
+	char *name = malloc(len + 3);
 	
-	line_no = 1;
-	la();
+	strcpy(name, source);
+	if( len > 2 && strcmp(name + len - 2, ".s") == 0 )
+		strcpy(name + len - 2, ".o");
+	else
+		strcat(name, ".o");
+	return name;
+}
+
+/* Assemble each module in a process of its own, up to jobs at a time. They share nothing, and
+ * the assembler keeps its state in globals, so a fork is all each one needs.
+ */
+int assemble_modules(char **sources, int num_sources, int jobs) {
+	pid_t *pids = calloc(num_sources, sizeof(pid_t));
+	int running = 0;
+	int failed = 0;
+	int status;
 	
-	// Write magic number
-	unsigned short magic = 0xd00d;
-	fwrite(&magic,sizeof(magic),1,ofp); 
+	for(int i=0; i<num_sources || running > 0; ) {
+		if( i < num_sources && running < jobs ) {
+			fflush(stdout);
+			pids[i] = fork();
+			if( pids[i] < 0 ) {
+				printf("Error: Can't start a process to assemble %s.\n", sources[i]);
+				exit(1);
+			}
+			if( pids[i] == 0 )
+				exit(assemble_file(sources[i], object_name(sources[i]), 0));
+			running++;
+			i++;
+			continue;
+		}
+		pid_t pid = wait(&status);
+		running--;
+		if( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			for(int j=0; j<num_sources; j++)
+				if( pids[j] == pid )
+					printf("Error: Assembling %s failed.\n", sources[j]);
+			failed = 1;
+		}
+	}
+	free(pids);
+	return failed;
+}
 
-	assemble();
-	fclose(fp);
-	fclose(ofp);
+int main(int argc, char* argv[]) {
+	int debug_map = 0;
+	int jobs = 0;
+	int show_cache_stats = 0;
 	
-	return 0;
-}		
\ No newline at end of file
+	while( argc > 1 && argv[1][0] == '-' ) {
+		if( strcmp(argv[1], "-g") == 0 )
+			debug_map = 1;
+		else if( strcmp(argv[1], "-O") == 0 )
+			optimise = 1;
+		else if( strcmp(argv[1], "-c") == 0 )
+			object_mode = 1;
+		else if( strcmp(argv[1], "-j") == 0 && argc > 2 ) {
+			jobs = atoi(argv[2]);
+			argv++;
+			argc--;
+		} else if( strcmp(argv[1], "--cache-dir") == 0 && argc > 2 ) {
+			cache_dir = argv[2];
+			argv++;
+			argc--;
+		} else if( strcmp(argv[1], "--cache-stats") == 0 )
+			show_cache_stats = 1;
+		else
+			break;
+		argv++;
+		argc--;
+	}
+	if( cache_dir != NULL && mkdir(cache_dir, 0777) != 0 && errno != EEXIST ) {
+		printf("Error: Can't create cache directory %s.\n", cache_dir);
+		exit(1);
+	}
+	if( show_cache_stats && cache_dir != NULL && argc == 1 ) {
+		cache_stats();
+		return 0;
+	}
+	if( (object_mode && (argc < 2 || debug_map)) || (! object_mode && argc != 3) ) {
+		printf("%s\n", ASM_VERSION);
+		printf("\n\tusage: nanoasm [-g] [-O] [--cache-dir <dir>] <source file> <out file>  e.g., nanoasm hello.asm hello.bin");
+		printf("\n\t       nanoasm -c [-O] [-j <n>] <source file>...  e.g., nanoasm -c main.s print.s");
+		printf("\n\n\t-g  Also write a debug map of addresses to source lines to <out file>.map");
+		printf("\n\t-O  Remove redundant instructions with the peephole optimiser");
+		printf("\n\t-c  Assemble modules into object files for nanold, name.s into name.o");
+		printf("\n\t-j  Assemble n modules at a time. The default is one per CPU.");
+		printf("\n\t--cache-dir <dir>  Keep assembled files in dir, and reuse them when the same source is assembled again");
+		printf("\n\t--cache-stats      Print the cache's hits and misses, and its size\n");
+		exit(1);
+	}
+	
+	int status;
+	if( ! object_mode )
+		status = assemble_file(argv[1], argv[2], debug_map);
+	else if( argc == 2 )
+		status = assemble_file(argv[1], object_name(argv[1]), 0);
+	else {
+		if( jobs <= 0 )
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if( jobs < 1 )
+			jobs = 1;
+		status = assemble_modules(argv + 1, argc - 1, jobs);
+	}
+	if( show_cache_stats && cache_dir != NULL )
+		cache_stats();
+	return status;
+}
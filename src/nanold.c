@@ -0,0 +1,242 @@
+/**
+ * nanold.c - The NanoVM linker
+ *
+ * Links modules assembled with nanoasm -c into a program image. The modules go one after
+ * another from the ORG address, in the order they are given, so the program starts at the
+ * first instruction of the first one. Each module's GLOBAL labels and constants are visible
+ * to all the others, and every relocation in a module is fixed up with the address of what
+ * it refers to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "object.h"
+
+#define MAX_MEM 65536
+#define SYMBOL_TABLE_SIZE 4096
+
+char* LD_VERSION = "NanoLD Version: 0.6";
+
+struct module {
+	char *name;								// Object file name
+	unsigned char *file;
+	struct object_header header;
+	unsigned char *code;
+	struct object_symbol *symbols;			// Copied out of the file, where they may not be aligned
+	struct object_relocation *relocations;
+	char *names;
+	unsigned short base;					// Where it is loaded
+};
+
+// A GLOBAL from one of the modules
+struct global {
+	char *name;
+	unsigned short value;
+	struct module *module;					// Where it is defined
+	struct global *next;					// Next global with the same hash
+};
+
+struct global *globals[SYMBOL_TABLE_SIZE];
+
+unsigned int symbol_hash(const char *name) {
+	unsigned int h = 0;
+
+	while( *name )
+		h = h * 33 + (unsigned char) *name++;
+	return h % SYMBOL_TABLE_SIZE;
+}
+
+struct global *find_global(const char *name) {
+	for(struct global *g = globals[symbol_hash(name)]; g != NULL; g = g->next)
+		if( strcmp(g->name, name) == 0 )
+			return g;
+	return NULL;
+}
+
+void add_global(char *name, unsigned short value, struct module *m) {
+	struct global *g = find_global(name);
+
+	if( g != NULL ) {
+		printf("Error: %s is defined in both %s and %s.\n", name, g->module->name, m->name);
+		exit(1);
+	}
+	g = malloc(sizeof(struct global));
+	g->name = name;
+	g->value = value;
+	g->module = m;
+	unsigned int h = symbol_hash(name);
+	g->next = globals[h];
+	globals[h] = g;
+}
+
+// Read an object file and check that it holds what its header says
+void read_module(struct module *m, char *name) {
+	FILE *fp = fopen(name, "rb");
+	long size;
+
+	if( ! fp ) {
+		printf("Error: Can't open file %s for reading.\n", name);
+		exit(1);
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	m->name = name;
+	m->file = malloc(size + 1);
+	if( m->file == NULL || fread(m->file, 1, size, fp) != (size_t) size ) {
+		printf("Error: Can't read file %s.\n", name);
+		exit(1);
+	}
+	fclose(fp);
+
+	if( (size_t) size < sizeof(struct object_header) ) {
+		printf("Error: %s is not a nanoasm object file. Bad magic number.\n", name);
+		exit(1);
+	}
+	memcpy(&m->header, m->file, sizeof(struct object_header));
+	if( m->header.magic != NANOOBJ_MAGIC ) {
+		printf("Error: %s is not a nanoasm object file. Bad magic number.\n", name);
+		exit(1);
+	}
+	size_t code_at = sizeof(struct object_header);
+	size_t symbols_at = code_at + m->header.code_size;
+	size_t relocations_at = symbols_at + (size_t) m->header.num_symbols * sizeof(struct object_symbol);
+	size_t names_at = relocations_at + (size_t) m->header.num_relocations * sizeof(struct object_relocation);
+	if( names_at + m->header.names_size != (size_t) size || m->header.code_size > MAX_MEM ) {
+		printf("Error: %s is damaged.\n", name);
+		exit(1);
+	}
+	m->code = m->file + code_at;
+	m->symbols = malloc(m->header.num_symbols * sizeof(struct object_symbol) + 1);
+	m->relocations = malloc(m->header.num_relocations * sizeof(struct object_relocation) + 1);
+	if( m->symbols == NULL || m->relocations == NULL ) {
+		printf("Error: Not enough memory for %s.\n", name);
+		exit(1);
+	}
+	memcpy(m->symbols, m->file + symbols_at, m->header.num_symbols * sizeof(struct object_symbol));
+	memcpy(m->relocations, m->file + relocations_at, m->header.num_relocations * sizeof(struct object_relocation));
+	m->names = (char *) (m->file + names_at);
+	m->file[size] = '\0';					// So the last name ends, even in a damaged file
+	for(unsigned int i=0; i<m->header.num_symbols; i++) {
+		if( m->symbols[i].name >= m->header.names_size ) {
+			printf("Error: %s is damaged.\n", name);
+			exit(1);
+		}
+	}
+}
+
+// Fix up the module's operands, now that it is in place in the image
+void relocate(struct module *m, unsigned char *image) {
+	for(unsigned int i=0; i<m->header.num_relocations; i++) {
+		struct object_relocation *r = &m->relocations[i];
+		unsigned short value;
+
+		if( r->offset + r->size > m->header.code_size || (r->size != 1 && r->size != 2) ||
+				(r->symbol != NANOOBJ_MODULE && (r->symbol < 0 || (unsigned int) r->symbol >= m->header.num_symbols)) ) {
+			printf("Error: %s is damaged.\n", m->name);
+			exit(1);
+		}
+		if( r->symbol == NANOOBJ_MODULE )
+			value = m->base + r->addend;
+		else {
+			char *name = m->names + m->symbols[r->symbol].name;
+			struct global *g = find_global(name);
+			if( g == NULL ) {
+				printf("Error: Undefined symbol '%s' in %s.\n", name, m->name);
+				exit(1);
+			}
+			value = g->value + r->addend;
+		}
+		if( r->type == NANOOBJ_LOW )
+			value &= 0xff;
+		else if( r->type == NANOOBJ_HIGH )
+			value >>= 8;
+
+		unsigned char *operand = image + m->base + r->offset;
+		if( r->size == 1 ) {
+			if( value > 255 ) {
+				printf("Error: An address doesn't fit in a byte operand in %s.\n", m->name);
+				exit(1);
+			}
+			operand[0] = (unsigned char) value;
+		} else {
+			operand[0] = (unsigned char) (value >> 8);
+			operand[1] = (unsigned char) (value & 0xff);
+		}
+	}
+}
+
+unsigned short parse_address(char *s) {
+	long n = s[0] == '$' ? strtol(s + 1, NULL, 16) : strtol(s, NULL, 0);
+
+	if( n < 0 || n >= MAX_MEM ) {
+		printf("Error: %s is not an address.\n", s);
+		exit(1);
+	}
+	return (unsigned short) n;
+}
+
+int main(int argc, char* argv[]) {
+	unsigned short org = 0x100;
+
+	if( argc > 2 && strcmp(argv[1], "--org") == 0 ) {
+		org = parse_address(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if( argc < 3 ) {
+		printf("%s\n", LD_VERSION);
+		printf("\n\tusage: nanold [--org <address>] <out file> <object file>...  e.g., nanold hello.bin main.o print.o");
+		printf("\n\n\t--org  Where the program is loaded and starts. The default is $100.\n");
+		exit(1);
+	}
+
+	int num_modules = argc - 2;
+	struct module *modules = calloc(num_modules, sizeof(struct module));
+	unsigned long address = org;
+	for(int i=0; i<num_modules; i++) {
+		read_module(&modules[i], argv[i + 2]);
+		modules[i].base = address;
+		address += modules[i].header.code_size;
+		if( address > MAX_MEM ) {
+			printf("Error: Program too large. Memory is %d bytes in size.\n", MAX_MEM);
+			exit(1);
+		}
+	}
+
+	for(int i=0; i<num_modules; i++) {
+		struct module *m = &modules[i];
+		for(unsigned int j=0; j<m->header.num_symbols; j++) {
+			struct object_symbol *sym = &m->symbols[j];
+			if( sym->type == NANOOBJ_LABEL )
+				add_global(m->names + sym->name, m->base + sym->value, m);
+			else if( sym->type == NANOOBJ_CONSTANT )
+				add_global(m->names + sym->name, sym->value, m);
+		}
+	}
+
+	// The image is the magic number and ORG, then the code, laid out as it will be in memory
+	unsigned char *image = calloc(MAX_MEM, 1);
+	for(int i=0; i<num_modules; i++) {
+		memcpy(image + modules[i].base, modules[i].code, modules[i].header.code_size);
+		relocate(&modules[i], image);
+	}
+
+	unlink(argv[1]);						// It could be a link into nanoasm's cache
+	FILE *ofp = fopen(argv[1], "wb");
+	if( ! ofp ) {
+		printf("Error: Can't open file %s for writing.\n", argv[1]);
+		exit(1);
+	}
+	unsigned short magic = 0xd00d;
+	fwrite(&magic, sizeof(magic), 1, ofp);
+	fwrite(&org, sizeof(org), 1, ofp);
+	fwrite(image + org, 1, address - org, ofp);
+	if( ferror(ofp) || fclose(ofp) != 0 ) {
+		printf("Error: Can't write file %s.\n", argv[1]);
+		exit(1);
+	}
+	return 0;
+}
@@ -5,474 +5,457 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include "nanovm.h"
+#include "batch.h"
 #include "opcodes.h"
 
 char* VM_VERSION = "NanoVM Version: 0.5.2 July 2021";
 
+// What to do about the memory dump once the program halts
+#define DUMP_ASK 0
+#define DUMP_YES 1
+#define DUMP_NO 2
+#define DUMP_MIN 512							// Bytes always dumped, the size memory used to be
+
 char get_printable_char(char c) {
 	if( c < 33 || c > 126 )
 			return '.';
 	return c;
 }
 
-void ask_dump_mem() {
+// Dump memory up to the last byte in use, and at least $0000 to $01ff
+void dump_mem(FILE *fp, unsigned char *memory) {
 	unsigned short width = 0;
 	unsigned char c;
 	unsigned short address = 0;
 	unsigned char buf[16];
 	unsigned int char_index = 0;
+	int end = MAX_MEM;
 	
-	printf("\nDump memory? (y or n) ");
-	c = getchar();
-	if( c == 'n' )
-		return;
-	
-	printf("$0000 to $%04x:\n", MAX_MEM - 1);
-	printf("%04x:   ", address);
-	for(int i=0; i<MAX_MEM; i++) {
+	while( end > DUMP_MIN && memory[end - 1] == 0 )
+		end--;
+	end = (end + 15) & ~15;
+	fprintf(fp, "$0000 to $%04x:\n", end - 1);
+	fprintf(fp, "%04x:   ", address);
+	for(int i=0; i<end; i++) {
 		c = memory[i];
 		buf[char_index++] = c;
-		printf("%02x ", c);
+		fprintf(fp, "%02x ", c);
 		width++;
 		if( width > 15 ) {
 			address += 16;
-			printf("  ");
+			fprintf(fp, "  ");
 			for(int j=0; j<16; j++) {
-				printf("%c", get_printable_char(buf[j]));
+				fputc(get_printable_char(buf[j]), fp);
 			}
 			char_index = 0;
-			if( i < MAX_MEM - 1 ) {
-				printf("\n");
-				printf("%04x:   ", address);
+			if( i < end - 1 ) {
+				fprintf(fp, "\n");
+				fprintf(fp, "%04x:   ", address);
 			}
 			width = 0;
 		}
 	}
 }
 
+void ask_dump_mem(unsigned char *memory) {
+	printf("\nDump memory? (y or n) ");
+	fflush(stdout);
+	if( getchar() == 'n' )
+		return;
+	dump_mem(stdout, memory);
+}
 
-void load(char *fname) {
-	// Read in program
-	FILE *fp;
-	size_t size;
-	unsigned char program[MAX_MEM];
-	
-	fp = fopen(fname, "rb");
-	if (fp == NULL){ /*ERROR detection if file == empty*/
-        printf("Error: There was an error reading the program image %s. File not found. \n", fname);           
-        exit(1);
-    }
-	
-	// Read magic number & load program into memory
-	unsigned short magic;
-	fread(&magic, sizeof(unsigned short), 1, fp);
-	if( magic != 0xd00d ) {
-		printf("Not a nanovm program image file. Bad magic number.\n");
-		exit(1);
-	}	
-		
-	// Load program image starting memory address
-	unsigned short org_address;
-	fread(&org_address, sizeof(unsigned short), 1, fp);
-	pc = org_address;
-	
-	fseek(fp,4, SEEK_END);
-	size = ftell(fp);
-	size -= 4;
-	fseek(fp, 4, SEEK_SET);
-	
-	fread(&program, sizeof(unsigned char), size, fp);
-	fclose(fp);
+// Read everything left on stdin so IN never has to wait for it
+char *read_stdin(size_t *size) {
+	size_t capacity = 4096;
+	char *text = malloc(capacity);
+	size_t n;
+
+	*size = 0;
+	while( (n = fread(text + *size, 1, capacity - *size, stdin)) > 0 ) {
+		*size += n;
+		if( *size == capacity )
+			text = realloc(text, capacity *= 2);
+	}
+	return text;
+}
+
+/* Map a program image file into memory read-only. Sets size to the size of the file. Files
+ * that can't be mapped, like pipes, are read into anonymous memory instead, so either way
+ * free_image() unmaps the result.
+ */
+unsigned char *read_image(char *fname, size_t *size) {
+	struct stat st;
+	unsigned char *image;
+	int fd;
 	
-	if( org_address + size - 4 > MAX_MEM ) {
-		printf("Error. Program too large. Memory is %d bytes in size.\n", MAX_MEM);
+	fd = open(fname, O_RDONLY);
+	if( fd < 0 ) {
+		printf("Error: There was an error reading the program image %s. File not found. \n", fname);           
 		exit(1);
 	}
-	
-	// Init memory
-	memory = (char *) malloc(MAX_MEM);
-	
-	// Zero memory
-	for(int i=0; i<MAX_MEM; i++) {
-		memory[i] = 0;
+	if( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ) {
+		*size = st.st_size;
+		image = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if( image != MAP_FAILED ) {
+			close(fd);
+			return image;
+		}
 	}
 	
-	// Init stack. Bottom of stack is positioned by default at address $007f (decimal: 127)
-	stack_pointer = STACK_BOTTOM_ADDRESS;//0x7f;
-		
-	// Copy program image into memory
-	for(int i=0; i<size - 4; i++) {
-		memory[org_address + i] = program[i];
-	}	
-	printf("Loaded %d bytes.\n", size - 4);
+	size_t capacity = 4096;
+	unsigned char *buffer = malloc(capacity);
+	ssize_t n;
+	*size = 0;
+	while( (n = read(fd, buffer + *size, capacity - *size)) > 0 ) {
+		*size += n;
+		if( *size == capacity )
+			buffer = realloc(buffer, capacity *= 2);
+	}
+	close(fd);
+	image = mmap(NULL, *size > 0 ? *size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	memcpy(image, buffer, *size);
+	free(buffer);
+	return image;
 }
 
-void push(unsigned char c) {
-	if( stack_pointer == 0 ) {
-		printf("Error. Out of stack space. Stack size is: %d bytes.\n", MAX_STACK);
-		exit(1);
-	}
-	memory[--stack_pointer] = c;
+void free_image(unsigned char *image, size_t size) {
+	munmap(image, size > 0 ? size : 1);
 }
 
-unsigned char pop() {
-	if( stack_pointer >= MAX_STACK - 1 ) {
-		printf("Error. Stack underflow. \n");
+// Name of a file that goes with the object file, e.g. hello.bin.snap
+char *file_name(char *fname, char *extension) {
+	char *name;
+	
+	if( fname == NULL )
+		fname = "nanovm";
+	name = malloc(strlen(fname) + strlen(extension) + 1);
+	sprintf(name, "%s%s", fname, extension);
+	return name;
+}
+
+/* Run up to the snapshot point, $address or a number of cycles, and write a snapshot there.
+ * A number of cycles takes the snapshot at the first jump or branch after that many.
+ * Returns 0 if the program halted first.
+ */
+int take_snapshot(NanoVM *vm, char *where, char *fname) {
+	unsigned long cycles = strtoul(where, NULL, 0);
+	int status;
+	
+	if( where[0] == '$' ) {
+		nanovm_break(vm, strtol(where + 1, NULL, 16) & 0xffff);
+		status = nanovm_run(vm, ~0UL);
+	} else
+		status = nanovm_run(vm, cycles > vm->cycles ? cycles - vm->cycles : 0);
+	if( status == NANOVM_HALTED || status == NANOVM_FAULT ) {
+		printf("Program %s before %s. No snapshot written.\n", status == NANOVM_HALTED ? "halted" : "stopped", where);
+		return 0;
+	}
+	
+	FILE *fp = fopen(fname, "wb");
+	if( fp == NULL || nanovm_save(vm, fp) != 0 ) {
+		printf("Error. Can't write snapshot to %s.\n", fname);
 		exit(1);
 	}
-	return memory[stack_pointer++];
+	fclose(fp);
+	printf("Wrote snapshot to %s at cycle %lu.\n", fname, vm->cycles);
+	return 1;
 }
 
-unsigned char peek() {
-	return memory[stack_pointer];
+/* The VM being traced, and where its trace goes. The trace is finished off at exit, so a
+ * program that stops on an error still leaves the instructions that led up to it.
+ */
+static NanoVM *traced_vm;
+static FILE *trace_fp;
+static char *trace_file;
+
+static void finish_trace() {
+	if( traced_vm == NULL )
+		return;
+	struct nanovm_trace *t = traced_vm->trace;
+	unsigned long records = t->fp != NULL || t->head < t->size ? t->head : t->size;
+	nanovm_trace_write(traced_vm, trace_fp);
+	nanovm_trace_stop(traced_vm);
+	fclose(trace_fp);
+	printf("Wrote a trace of %lu instructions to %s.\n", records, trace_file);
+	traced_vm = NULL;
 }
 
-char stack_is_empty() {
-	return stack_pointer == STACK_BOTTOM_ADDRESS;
+// A number of instructions, with k or M for thousands or millions
+static unsigned long parse_count(char *s) {
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+	if( *end == 'k' || *end == 'K' )
+		n *= 1000;
+	else if( *end == 'm' || *end == 'M' )
+		n *= 1000000;
+	return n;
 }
 
-unsigned char fetchUInt8(unsigned short address) {
-	return memory[address];
+void usage() {
+	printf("%s\n", VM_VERSION);
+	printf("\n\tusage: nanovm [options] <object file> e.g., nanovm hello.bin\n");
+	printf("\n\t--no-fuse       Run every instruction on its own, without superinstructions\n");
+	printf("\t--fuse-profile  Only fuse instruction sequences that turn out to be hot\n");
+	printf("\t--jit           Compile hot code to native x86-64 code\n");
+	printf("\t--dump          Dump memory after the program halts, without asking\n");
+	printf("\t--no-dump       Don't dump memory or ask whether to\n");
+	printf("\t--dump-file <f> Write the memory dump to file f, without asking\n");
+	printf("\t--snapshot-at <$address|cycles>\n");
+	printf("\t                Write a snapshot of the machine when it gets to address, or after cycles\n");
+	printf("\t--snapshot-file <f> Where --snapshot-at writes to. Defaults to <object file>.snap\n");
+	printf("\t--restore <f>   Carry on from snapshot f. The object file is optional.\n");
+	printf("\t--profile       Count what runs and write a hot spot report to <object file>.prof\n");
+	printf("\t--map <f>       Debug map from nanoasm -g. Defaults to <object file>.map, if there is one.\n");
+	printf("\t--trace         Write every instruction run to <object file>.trace\n");
+	printf("\t--trace-last <n> Keep the last n instructions (n can end in k or M) and write them\n");
+	printf("\t                to <object file>.trace when the program halts or stops on an error\n");
+	printf("\t--trace-file <f> Where --trace and --trace-last write to\n");
+	printf("\t--print-trace <f> Print trace file f as text\n");
+	printf("\t--max-cycles <n> Stop after about n cycles, with exit status %d\n", NANOVM_CYCLE_LIMIT);
+	printf("\t--max-time <s>  Stop after about s seconds, with exit status %d\n", NANOVM_TIME_LIMIT);
+	printf("\t--max-output <n> Stop rather than print more than n bytes, with exit status %d\n", NANOVM_OUTPUT_LIMIT);
+	printf("\n\tnanovm --batch [options] <object file>...\n");
+	printf("\n\tRuns every object file on a pool of threads and prints their output in order.\n");
+	printf("\t--inputs <file> Run one object file once for each line of file, which IN reads from\n");
+	printf("\t--threads <n>   Number of threads. Defaults to the number of cores.\n");
+	printf("\t--restore <f>   Start every job from snapshot f\n");
+	printf("\t--max-cycles, --max-time and --max-output apply to each job\n");
+	exit(1);
 }
 
 int main(int argc, char *argv[]) {
-	if( argc != 2 ) {
-		printf("%s\n", VM_VERSION);
-		printf("\n\tusage: nanovm <object file> e.g., nanovm hello.bin\n");
+	char *fname = NULL;
+	char **images = malloc(argc * sizeof(char *));
+	int num_images = 0;
+	int options = 0;
+	int batch_mode = 0;
+	char *inputs = NULL;
+	int threads = 0;
+	int dump = DUMP_ASK;
+	char *dump_file = NULL;
+	char *snapshot_at = NULL;
+	char *snapshot_file = NULL;
+	char *restore = NULL;
+	char *map_file = NULL;
+	int trace = 0;
+	unsigned long trace_last = 0;
+	struct nanovm_limits limits = { 0, 0, 0 };
+	int status;
+	struct timeval stop, start;
+	
+	for(int i=1; i<argc; i++) {
+		if( strcmp(argv[i], "--batch") == 0 )
+			batch_mode = 1;
+		else if( strcmp(argv[i], "--inputs") == 0 && i + 1 < argc )
+			inputs = argv[++i];
+		else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc )
+			threads = atoi(argv[++i]);
+		else if( strcmp(argv[i], "--no-fuse") == 0 )
+			options |= NANOVM_NO_FUSE;
+		else if( strcmp(argv[i], "--fuse-profile") == 0 )
+			options |= NANOVM_FUSE_PROFILE;
+		else if( strcmp(argv[i], "--jit") == 0 )
+			options |= NANOVM_JIT;
+		else if( strcmp(argv[i], "--dump") == 0 )
+			dump = DUMP_YES;
+		else if( strcmp(argv[i], "--no-dump") == 0 )
+			dump = DUMP_NO;
+		else if( strcmp(argv[i], "--dump-file") == 0 && i + 1 < argc ) {
+			dump = DUMP_YES;
+			dump_file = argv[++i];
+		}
+		else if( strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc )
+			snapshot_at = argv[++i];
+		else if( strcmp(argv[i], "--snapshot-file") == 0 && i + 1 < argc )
+			snapshot_file = argv[++i];
+		else if( strcmp(argv[i], "--restore") == 0 && i + 1 < argc )
+			restore = argv[++i];
+		else if( strcmp(argv[i], "--profile") == 0 )
+			options |= NANOVM_PROFILE;
+		else if( strcmp(argv[i], "--map") == 0 && i + 1 < argc )
+			map_file = argv[++i];
+		else if( strcmp(argv[i], "--trace") == 0 )
+			trace = 1;
+		else if( strcmp(argv[i], "--trace-last") == 0 && i + 1 < argc ) {
+			trace = 1;
+			trace_last = parse_count(argv[++i]);
+		}
+		else if( strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc )
+			limits.max_cycles = parse_count(argv[++i]);
+		else if( strcmp(argv[i], "--max-time") == 0 && i + 1 < argc )
+			limits.max_micros = atof(argv[++i]) * 1000000;
+		else if( strcmp(argv[i], "--max-output") == 0 && i + 1 < argc )
+			limits.max_output = parse_count(argv[++i]);
+		else if( strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc )
+			trace_file = argv[++i];
+		else if( strcmp(argv[i], "--print-trace") == 0 && i + 1 < argc ) {
+			FILE *fp = fopen(argv[++i], "rb");
+			if( fp == NULL || nanovm_print_trace(fp, stdout) != 0 ) {
+				printf("Error. %s is not a nanovm trace file.\n", argv[i]);
+				exit(1);
+			}
+			fclose(fp);
+			exit(0);
+		}
+		else if( argv[i][0] == '-' )
+			usage();
+		else
+			images[num_images++] = argv[i];
+	}
+	if( batch_mode )
+		return run_batch(images, num_images, inputs, options, threads, restore, &limits);
+	if( num_images > 1 || inputs != NULL || (num_images == 0 && restore == NULL) )
+		usage();
+	if( num_images == 1 )
+		fname = images[0];
+	if( trace && options & NANOVM_PROFILE ) {
+		printf("Error. --profile and --trace can't be used together.\n");
 		exit(1);
 	}
 	
-	unsigned char input;
-	unsigned short address;
-	unsigned char source;
-	unsigned char opcode;
-	unsigned char n;
-	unsigned char buf[2]; 
-	unsigned char cmp_value;
-	unsigned char cmp_x_value;
-	unsigned char cmp_y_value;
-	unsigned char a,b;
-	unsigned long total_cycles = 0;
+	NanoVM *vm = nanovm_create(options);
+	if( vm == NULL ) {
+		printf("Error. Not enough memory for a VM.\n");
+		exit(1);
+	}
+	if( options & NANOVM_JIT && ! vm->jit_mode )
+		printf("JIT compiler not available. Interpreting instead.\n");
 	
-	acc = 0;
-	x = 0;
-	y = 0;
-	run = 1;
-	z_flag = 0;
+	size_t size = 0;
+	unsigned char *image = NULL;
+	if( fname != NULL ) {
+		image = read_image(fname, &size);
+		switch( nanovm_load_shared(vm, image, size) ) {
+		case NANOVM_BAD_MAGIC:
+			printf("Not a nanovm program image file. Bad magic number.\n");
+			exit(1);
+		case NANOVM_TOO_LARGE:
+			printf("Error. Program too large. Memory is %d bytes in size.\n", MAX_MEM);
+			exit(1);
+		}
+		printf("Loaded %u bytes.\n", vm->image_size);
+	}
 	
-	load(argv[1]);
+	// Errors and the profile give source lines when there is a debug map
+	FILE *map = NULL;
+	if( map_file != NULL ) {
+		map = fopen(map_file, "r");
+		if( map == NULL ) {
+			printf("Error. Can't open debug map %s.\n", map_file);
+			exit(1);
+		}
+	} else if( fname != NULL )
+		map = fopen(file_name(fname, ".map"), "r");
+	if( map != NULL ) {
+		if( nanovm_load_map(vm, map) != 0 )
+			printf("Not a nanoasm debug map. Ignoring it.\n");
+		fclose(map);
+	}
 	
-	gettimeofday(&start, NULL);
+	size_t snapshot_size = 0;
+	unsigned char *snapshot = NULL;
+	if( restore != NULL ) {
+		snapshot = read_image(restore, &snapshot_size);
+		if( nanovm_restore(vm, snapshot, snapshot_size) != NANOVM_OK ) {
+			printf("Not a nanovm snapshot file.\n");
+			exit(1);
+		}
+		printf("Restored snapshot at cycle %lu.\n", vm->cycles);
+	}
+	unsigned long start_cycles = vm->cycles;
 	
-	// Execute loaded program
-	while( run ) {
-		mar = pc;    					// Program counter to memory address register
-		ir = memory[mar];				// Fetch instruction
-		opcode = ir;					// Get the opcode
-			
-		//printf("pc: %x (%d) opcode: %d acc: %d memory[pc]: %d\n", pc, pc, opcode, acc, memory[pc]);
-		pc++; 							// Increment pc
-		
-		
-		// Decode & execute the instruction		
-		switch(opcode) {
-		case LDA_IMM: 
-			acc = fetchUInt8(pc++); 
-			zeroflag(acc);
-			break;
-		case LDA_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc = memory[address];
-			zeroflag(acc);
-			break;
-		case STA: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			memory[address] = acc; 
-			break;
-		case LDX_IMM: 
-			x = fetchUInt8(pc++); 
-			zeroflag(x);
-			break;
-		case LDX_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			x = memory[address];
-			zeroflag(x);
-			break;
-		case STX: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			memory[address] = x; 
-			break;
-		case LDY_IMM: 
-			y = fetchUInt8(pc++); 
-			zeroflag(y);
-			break;
-		case LDY_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			y = memory[address];
-			zeroflag(y);
-			break;
-		case STY: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			memory[address] = y; 
-			break;
-		case ADD_IMM: 
-			acc += fetchUInt8(pc++) + carry_flag; 
-			zeroflag(acc);
-			carryflag(acc);
-			break;
-		case ADD_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc += memory[address] + carry_flag; 
-			zeroflag(acc);
-			carryflag(acc);
-			break; 
-		case SUB_IMM: 
-			source = (~fetchUInt8(pc++)) + carry_flag; 	// Two's complement subtraction with carry see: https://en.wikipedia.org/wiki/Carry_flag
-			acc += source; 
-			zeroflag(acc);
-			carryflag(acc);
-			break;
-		case SUB_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc += (~memory[address]) + carry_flag; 		// Two's complement subtraction with carry see: https://en.wikipedia.org/wiki/Carry_flag
-			zeroflag(acc);
-			carryflag(acc);
-			break;
-		case MUL_IMM: 
-			acc *= fetchUInt8(pc++); 
-			zeroflag(acc);
-			carryflag(acc);
-			break;
-		case MUL_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc *= memory[address]; 
-			zeroflag(acc);
-			carryflag(acc);
-			break;
-		case DIV_IMM: 
-			n = fetchUInt8(pc++);
-			if( n == 0 ) {
-				printf("Error. Division by zero. PC: $%x\n", pc-1);
-				exit(1);
-			}
-			acc /= n; 
-			zeroflag(acc);
-			//carryflag(acc);
-			break;
-		case DIV_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			n = memory[address];
-			if( n == 0 ) {
-				printf("Error. Division by zero. PC: $%x\n", pc-2);
-				exit(1);
-			}
-			acc /= n; 
-			zeroflag(acc);
-			//carryflag(acc);
-			break;
-		case JMP: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			pc = address; 
-			break;
-		case JMP_IND: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			address = fetchUInt8(address) << 8 | fetchUInt8(address+1);
-			pc = address; 
-			break;
-		case JEQ: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			if( z_flag == 1 ) 
-				pc = address; 
-			break;
-		case JNE: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			if( z_flag == 0 ) { 
-				pc = address;
-			}
-			break;
-		case JCS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			if( carry_flag == 1 ) 
-				pc = address; 
-			break;
-		case JCC: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			if( carry_flag == 0 ) { 
-				pc = address;
-			}
-			break;	
-		case HALT: run = 0; break;
-		case IN: scanf("%d", &input); acc = input; break;
-		case OUT: printf("%d\n", (unsigned char) acc); break;
-		case JSR:	
-			buf[0] = fetchUInt8(pc++);	// Fetch subroutine address
-			buf[1] = fetchUInt8(pc++);
-			push( pc >> 8);				// Push return address on stack
-			push( pc & 0x0F);
-			pc = buf[0] << 8 | buf[1]; // set pc to subroutine address
-			break;
-		case RTS:
-			buf[1] = pop();				// pop return address from stack
-			buf[0] = pop();
-			pc = buf[0] << 8 | buf[1];	// set pc to return address
-			break;
-		case CMP_IMM:
-			cmp_value = fetchUInt8(pc++);
-			if( acc - cmp_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case CMP_ABS:
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			cmp_value = memory[address]; 
-			if( acc - cmp_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case PUSHA:
-			push(acc);
-			break;
-		case POPA:
-			acc = pop();
-			zeroflag(acc);
-			break;
-		case SHL:
-			acc = (acc << 1);					// 6502 & ARM CPU do this. Left-most bit ends up in carry flag.
-			carryflag(acc);
-			zeroflag(acc);
-		case SHR:
-			if( acc & 1 == 1 ) carry_flag = 1;	// 6502 & ARM CPU do this. Right-most bit ends up in carry flag
-			acc = (acc >> 1);
-			zeroflag(acc);
-			break;
-		case INC:
-			acc++;
-			carryflag(acc);
-			zeroflag(acc);
-			break;
-		case DEC:
-			acc--;
-			carryflag(acc);
-			zeroflag(acc);
-			break;
-		case NOP:
-			;
-			break;
-		case CPX_IMM:
-			cmp_x_value = fetchUInt8(pc++);
-			if( x - cmp_x_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case CPX_ABS:
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			cmp_x_value = memory[address]; 
-			if( x - cmp_x_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case CPY_IMM:
-			cmp_y_value = fetchUInt8(pc++);
-			if( y - cmp_y_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case CPY_ABS:
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			cmp_y_value = memory[address]; 
-			if( y - cmp_y_value == 0 ) z_flag = 1;
-			else z_flag = 0;
-			break;
-		case TAX:
-			x = acc;
-			break;
-		case TAY:
-			y = acc;
-			break;
-		case TXA:
-			acc = x;
-			zeroflag(acc);
-			break;
-		case TYA:
-			acc = y;
-			zeroflag(acc);
-			break;
-		case INX:
-			x++;
-			zeroflag(x);
-			break;
-		case INY:
-			y++;
-			zeroflag(y);
-			break;
-		case DEX:
-			x--;
-			zeroflag(x);
-			break;
-		case DEY:
-			y--;
-			zeroflag(y);
-			break;
-		case NEG:
-			acc = (~acc) + 1;
-			break;
-		case DUP:
-			if( ! stack_is_empty() ) {
-				char c = peek();
-				push(c);
-			}
-			break;
-		case SWAP:
-			a = pop();
-			b = pop();
-			push(a);
-			push(b);
-			break;
-		case AND_IMM: 
-			acc = acc & fetchUInt8(pc++); 
-			zeroflag(acc);
-			break;
-		case AND_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc = acc & memory[address]; 
-			zeroflag(acc);
-			break; 	
-		case OR_IMM: 
-			acc = acc | fetchUInt8(pc++); 
-			zeroflag(acc);
-			break;
-		case OR_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc = acc | memory[address]; 
-			zeroflag(acc);
-			break; 	
-		case XOR_IMM: 
-			acc = acc ^ fetchUInt8(pc++); 
-			zeroflag(acc);
-			break;
-		case XOR_ABS: 
-			address = fetchUInt8(pc++) << 8 | fetchUInt8(pc++); 
-			acc = acc ^ memory[address]; 
-			zeroflag(acc);
-			break; 	
-		case NOT: 
-			acc = ~acc;  
-			zeroflag(acc);
-			break;
-		case CLC: 
-			carry_flag = 0;
-			break;
-		case SEC: 
-			carry_flag = 1;
-			break;
-		default:
-			printf("Error. Unhandled instruction code: %d Program Counter Address: $%x\n", opcode, pc);
+	if( snapshot_at != NULL && snapshot_file == NULL )
+		snapshot_file = file_name(fname, ".snap");
+	
+	if( trace ) {
+		if( trace_file == NULL )
+			trace_file = file_name(fname, ".trace");
+		trace_fp = fopen(trace_file, "wb");
+		if( trace_fp == NULL ) {
+			printf("Error. Can't write trace to %s.\n", trace_file);
+			exit(1);
+		}
+		if( nanovm_trace_start(vm, trace_last > 0 ? trace_last : NANOVM_TRACE_BUFFER, trace_last > 0 ? NULL : trace_fp) != 0 ) {
+			printf("Error. Not enough memory to trace.\n");
 			exit(1);
-        }	
-		total_cycles++;
+		}
+		traced_vm = vm;
+		atexit(finish_trace);
 	}
 	
+	// Nobody will be asked anything, so IN can have all of a piped stdin up front
+	if( dump != DUMP_ASK && ! isatty(0) ) {
+		size_t input_size;
+		char *text = read_stdin(&input_size);
+		nanovm_set_input(vm, text, input_size);
+		free(text);
+	}
+	
+	gettimeofday(&start, NULL);
+	status = NANOVM_HALTED;
+	if( snapshot_at == NULL || take_snapshot(vm, snapshot_at, snapshot_file) )
+		status = nanovm_run_limited(vm, &limits);
+	else if( vm->fault != NANOVM_NO_FAULT )
+		status = NANOVM_FAULT;
 	gettimeofday(&stop, NULL);
 	unsigned long period = (stop.tv_sec - start.tv_sec) * 1000000 + stop.tv_usec - start.tv_usec;
 	
-	printf("Number of cycles: %lu. Execution time %lu microseconds.\n", total_cycles, period);
-	ask_dump_mem();
-	return 0;
+	if( status == NANOVM_FAULT )
+		nanovm_print_fault(vm, stdout);
+	else if( status == NANOVM_CYCLE_LIMIT )
+		printf("Stopped at $%04x. Cycle limit of %lu reached.\n", vm->pc, limits.max_cycles);
+	else if( status == NANOVM_TIME_LIMIT )
+		printf("Stopped at $%04x. Time limit of %.3f seconds reached.\n", vm->pc, limits.max_micros / 1000000.0);
+	else if( status == NANOVM_OUTPUT_LIMIT )
+		printf("Stopped at $%04x. Output limit of %lu bytes reached.\n", vm->pc, limits.max_output);
+	printf("Number of cycles: %lu. Execution time %lu microseconds.\n", vm->cycles, period);
+	if( vm->fuse_mode != FUSE_OFF )
+		printf("Fused %u instruction sequences into superinstructions.\n", vm->fused_sites);
+	if( vm->jit_mode )
+		printf("Compiled %u blocks to native code.\n", vm->compiled_blocks);
+	if( period > 0 )
+		printf("%.0f cycles per second (%s dispatch).\n", (vm->cycles - start_cycles) * 1000000.0 / period, nanovm_dispatch_name());
+	if( vm->profile != NULL ) {
+		char *profile_file = file_name(fname, ".prof");
+		FILE *fp = fopen(profile_file, "w");
+		if( fp == NULL ) {
+			printf("Error. Can't write profile to %s.\n", profile_file);
+			exit(1);
+		}
+		nanovm_profile_report(vm, fp);
+		fclose(fp);
+		printf("Wrote profile to %s.\n", profile_file);
+	}
+	finish_trace();
+	if( dump == DUMP_ASK )
+		ask_dump_mem(vm->memory);
+	else if( dump == DUMP_YES && dump_file != NULL ) {
+		FILE *fp = fopen(dump_file, "w");
+		if( fp == NULL ) {
+			printf("Error. Can't write memory dump to %s.\n", dump_file);
+			exit(1);
+		}
+		dump_mem(fp, vm->memory);
+		fprintf(fp, "\n");
+		fclose(fp);
+	} else if( dump == DUMP_YES ) {
+		dump_mem(stdout, vm->memory);
+		printf("\n");
+	}
+	nanovm_destroy(vm);
+	if( image != NULL )
+		free_image(image, size);
+	if( snapshot != NULL )
+		free_image(snapshot, snapshot_size);
+	if( status == NANOVM_FAULT )
+		return 1;
+	return status == NANOVM_HALTED ? 0 : status;
 }//:-)
\ No newline at end of file
@@ -1,25 +1,266 @@
 #ifndef nanovm
 #define nanovm
 
+#include <stdio.h>
+#include <pthread.h>
+#include "jit.h"
 
-#define MAX_MEM 512 							// Maximum size of memory
+/* nanovm.h - The VM as a library.
+ *
+ * All of a machine's state lives in a NanoVM, so a host can run any number of independent
+ * programs in one process:
+ *
+ *	NanoVM *vm = nanovm_create(0);
+ *	nanovm_load(vm, image, size);
+ *	while( nanovm_run(vm, 100000) == NANOVM_OUT_OF_CYCLES )
+ *		;
+ *	nanovm_reset(vm);		// Run it again from the start
+ *	nanovm_destroy(vm);
+ *
+ * nanovm_create() returns NULL if there isn't the memory for a machine.
+ *
+ * nanovm_run() checks its cycles at jumps and at the end of memory, so it can go over by the
+ * straight-line code before the next one, never more than a pass through memory. That is less
+ * than NANOVM_SLICE, so nanovm_run_limited() honours its limits to within one slice.
+ */
+
+#define MAX_MEM 65536 							// Size of memory, the whole 16 bit address space
+#define MEM_PAGE 4096							// Memory is committed a page at a time, when first touched
 #define MAX_STACK 128							// Max size of stack in bytes
 #define STACK_BOTTOM_ADDRESS 0x7f				// Address of the bottom of the stack
 
 #define zeroflag(n) { if((n) & 0x00ff) z_flag = 0; else z_flag = 1; }					// Z flag set and clear
 #define carryflag(n) { if ((n) & 0x0100) carry_flag = 1; else carry_flag = 0; }			// Carry flag set and clear
-unsigned short pc = 0;							// Program counter
-unsigned short acc = 0;	                        // Accumulator
-unsigned short x = 0;							// X register
-unsigned short y = 0;							// Y register
-unsigned short mar;                             // Memory address register
-unsigned char ir;	                            // Instruction register
-unsigned short operand;                         // The 8 bit operand from the instruction register
-unsigned char* memory;							// The memory
-unsigned short run;                             // Execute while run is true
-unsigned char z_flag;							// Zero flag
-unsigned char carry_flag;						// Carry flag
-signed short stack_pointer;						// Address stack pointer is pointing to
-struct timeval stop, start;
-	
-#endif
\ No newline at end of file
+
+// Options for nanovm_create()
+#define NANOVM_NO_FUSE 1						// Run every instruction on its own
+#define NANOVM_FUSE_PROFILE 2					// Only fuse sequences that turn out to be hot
+#define NANOVM_JIT 4							// Compile hot code to native code
+#define NANOVM_PROFILE 8						// Count what runs, one instruction at a time. See nanovm_profile_report().
+
+// nanovm_load() results
+#define NANOVM_OK 0
+#define NANOVM_BAD_MAGIC -1						// Not a program image
+#define NANOVM_TOO_LARGE -2						// Doesn't fit in memory
+#define NANOVM_BAD_SNAPSHOT -3					// Not a snapshot, or a damaged one (nanovm_restore())
+
+#define NANOVM_OUTPUT_BUFFER 65536				// Bytes of OUT output held before they are written
+
+// nanovm_run() results
+#define NANOVM_HALTED 0							// The program ran HALT
+#define NANOVM_OUT_OF_CYCLES 1					// Used up the cycles it was given
+#define NANOVM_BREAK 2							// Got to the address given to nanovm_break()
+#define NANOVM_CYCLE_LIMIT 3					// Ran for max_cycles (nanovm_run_limited())
+#define NANOVM_TIME_LIMIT 4						// Ran for max_micros
+#define NANOVM_OUTPUT_LIMIT 5					// The next OUT would go past max_output
+#define NANOVM_FAULT 6							// The program did something it can't, see vm->fault
+
+// Faults. The machine stops at the instruction that faulted, before it has changed anything.
+#define NANOVM_NO_FAULT 0
+#define NANOVM_STACK_OVERFLOW 1					// Pushed onto a full stack
+#define NANOVM_STACK_UNDERFLOW 2				// Popped from an empty stack
+#define NANOVM_DIVIDE_BY_ZERO 3
+#define NANOVM_ILLEGAL_INSTRUCTION 4			// Not a valid opcode
+#define NANOVM_BAD_ADDRESS 5					// Instruction or address runs past $ffff
+
+// Limits for nanovm_run_limited(). 0 means no limit.
+#define NANOVM_SLICE (1 << 20)					// Cycles run between looks at the clock
+
+struct nanovm_limits {
+	unsigned long max_cycles;					// Cycles for this run
+	unsigned long max_micros;					// Wall time for this run
+	unsigned long max_output;					// Bytes of OUT output since the program was loaded
+};
+
+// Pre-decoded instruction cache. Each address that has been executed gets an entry with
+// the instruction's handler, its operand and the address of the following instruction.
+#define OP_DECODE 0								// Entry not decoded yet
+#define OP_ILLEGAL 255							// Not a valid opcode
+#define DECODED(opcode) ((opcode) + 1)			// Handler number of an opcode
+
+// Superinstructions. Each runs a fixed sequence of instructions with one dispatch. The
+// entry at the first instruction gets the superinstruction's handler; the entries of the
+// instructions that follow keep their own handlers and supply the operands.
+#define FUSED_LDA_SUB_STA_JNE	(DECODED(NUM_OPCODES) + 0)	// LDA abs, SUB #, STA abs, JNE
+#define FUSED_LDA_ADD_STA		(DECODED(NUM_OPCODES) + 1)	// LDA abs, ADD abs, STA abs
+#define FUSED_LDA_STA			(DECODED(NUM_OPCODES) + 2)	// LDA abs, STA abs
+#define FUSED_LDA_IMM_STA		(DECODED(NUM_OPCODES) + 3)	// LDA #, STA abs
+#define FUSED_CMP_JEQ			(DECODED(NUM_OPCODES) + 4)	// CMP #, JEQ
+#define FUSED_CMP_JNE			(DECODED(NUM_OPCODES) + 5)	// CMP #, JNE
+#define FUSED_SUB_JNE			(DECODED(NUM_OPCODES) + 6)	// SUB #, JNE
+#define FUSED_DEX_JNE			(DECODED(NUM_OPCODES) + 7)	// DEX, JNE
+#define FUSED_DEY_JNE			(DECODED(NUM_OPCODES) + 8)	// DEY, JNE
+#define OP_FUSE_CANDIDATE		(DECODED(NUM_OPCODES) + 9)	// Superinstruction site still being profiled
+#define OP_JIT_COUNT			(DECODED(NUM_OPCODES) + 10)	// Branch target counting towards JIT_THRESHOLD
+#define OP_JIT_ENTER			(DECODED(NUM_OPCODES) + 11)	// Start of a compiled block
+#define OP_BREAK				(DECODED(NUM_OPCODES) + 12)	// Breakpoint, see nanovm_break()
+#define OP_WRAP					(DECODED(NUM_OPCODES) + 13)	// Instruction at the end of memory, see decode_instruction()
+#define MAX_FUSED_BYTES 11								// Longest sequence a superinstruction covers
+
+#define FUSE_OFF 0										// Run every instruction on its own
+#define FUSE_ALL 1										// Fuse every sequence found when decoding
+#define FUSE_PROFILE 2									// Fuse only sequences that turn out to be hot
+#define FUSE_THRESHOLD 64								// Executions before a profiled site is fused
+
+struct decoded {
+	unsigned char op;							// Handler number
+	unsigned char opcode;						// Opcode the entry was decoded from
+	unsigned short operand;						// Immediate value or absolute address
+	unsigned short next;						// Address of the following instruction
+	unsigned char fuse;							// Superinstruction waiting to be enabled
+	unsigned char hits;							// Executions counted towards FUSE_THRESHOLD
+};
+
+// JIT compiler. Branch targets count their executions, and hot ones are compiled into
+// native blocks. An entry counting or running a block keeps the op it had in fuse.
+#define JIT_TARGET 1									// Some branch jumps to the address
+#define JIT_COVERED 2									// The address is inside a compiled block
+#define JIT_MAX_BLOCKS 4096								// Blocks compiled before the JIT gives up
+
+struct jit_range {
+	unsigned short start;
+	unsigned int end;
+	jit_block code;
+};
+
+/* Snapshots. A header padded to MEM_PAGE bytes, then every page of memory that isn't all
+ * zeros, in address order. Pages sit at page-aligned offsets in the file, so a snapshot
+ * can be written to a pipe in one pass or mapped and restored from in place.
+ */
+#define NANOVM_SNAPSHOT_MAGIC 0x5056534e			// "NSVP"
+
+struct nanovm_snapshot {
+	unsigned int magic;
+	unsigned int num_pages;						// Pages of memory after the header
+	unsigned long long cycles;
+	unsigned short pc;
+	unsigned short acc;
+	unsigned short x;
+	unsigned short y;
+	signed short stack_pointer;
+	unsigned char z_flag;
+	unsigned char carry_flag;
+	unsigned char pages[MAX_MEM / MEM_PAGE];	// Page number of each page that follows
+};
+
+// Profile. Counts for every address, kept by the profiling copy of the dispatch loop.
+#define PROFILE_HOT_SPOTS 40							// Addresses in the report
+
+struct nanovm_profile {
+	unsigned long executed[MAX_MEM];			// Times the instruction at each address ran
+	unsigned long taken[MAX_MEM];				// Times the branch at each address was taken
+};
+
+/* Trace. One fixed-size record per instruction, with the registers as the instruction found
+ * them, goes into a ring buffer. Either a thread streams the buffer to a file as it fills,
+ * or the buffer keeps the last records in memory until nanovm_trace_write().
+ */
+#define NANOVM_TRACE_MAGIC 0x5254564e				// "NVTR"
+#define NANOVM_TRACE_BUFFER (1 << 20)				// Records buffered when streaming
+#define TRACE_CHUNK 4096							// Records the VM writes between handing them over
+
+struct nanovm_trace_record {
+	unsigned short pc;
+	unsigned short acc;
+	unsigned short x;
+	unsigned short y;
+	signed short stack_pointer;
+	unsigned char opcode;
+	unsigned char flags;						// Z flag in bit 0, carry flag in bit 1
+};
+
+struct nanovm_trace_header {
+	unsigned int magic;
+	unsigned int record_size;
+	unsigned long long first_cycle;				// Cycle of the first record that follows
+};
+
+struct nanovm_trace {
+	struct nanovm_trace_record *records;
+	unsigned long size;							// A power of two
+	unsigned long head;							// Records written by the VM
+	unsigned long published;					// Records the writer thread may have
+	unsigned long written;						// Records the writer thread is done with
+	unsigned long first_cycle;					// Cycle of record 0
+	FILE *fp;									// Where the writer thread streams to, or NULL
+	pthread_t writer;
+	int stop;
+	unsigned char fuse_mode;					// The VM's, put back by nanovm_trace_stop()
+	unsigned char jit_mode;
+};
+
+typedef struct NanoVM {
+	// Machine state
+	unsigned char *memory;						// The memory
+	signed short stack_pointer;					// Address stack pointer is pointing to
+	unsigned short pc;							// Program counter
+	unsigned short acc;							// Accumulator
+	unsigned short x;							// X register
+	unsigned short y;							// Y register
+	unsigned char z_flag;						// Zero flag
+	unsigned char carry_flag;					// Carry flag
+	unsigned long cycles;						// Instructions run since the program was loaded
+	unsigned char halted;						// The program has run HALT
+	unsigned char fault;						// Why the last run stopped with NANOVM_FAULT
+	int break_address;							// Where nanovm_run() stops next, or -1
+	FILE *in;									// IN reads numbers from here, stdin unless the host changes it
+	FILE *out;									// OUT writes here, stdout unless the host changes it
+	char *input;								// Input for IN read in advance (nanovm_set_input), or NULL
+	char *input_pos;							// Where the next IN carries on from
+	char *output;								// OUT output not written to out yet
+	unsigned int output_size;
+	unsigned long output_bytes;					// Bytes OUT has written since the program was loaded
+	unsigned long output_limit;					// OUT stops the run rather than go past this, or 0
+
+	// Program image, kept so nanovm_reset() can put it back
+	const unsigned char *image;					// The code, after the header
+	unsigned int image_size;
+	unsigned short org;
+	unsigned char image_owned;					// image is our own copy, freed with the VM
+
+	// Instruction cache and superinstructions
+	struct decoded *decoded;					// One entry per address
+	unsigned int code_lo, code_hi;				// Range of addresses that have been decoded
+	unsigned char fuse_mode;					// FUSE_OFF, FUSE_ALL or FUSE_PROFILE
+	unsigned int fused_sites;					// Superinstructions enabled so far
+
+	// JIT compiler
+	unsigned char jit_mode;						// Compile hot blocks
+	unsigned char *jit_flags;					// JIT_TARGET and JIT_COVERED for each address
+	jit_block *jit_code;						// Compiled block starting at each address
+	struct jit_range *jit_blocks;				// Every block compiled, for invalidation
+	unsigned int compiled_blocks;
+	struct jit_buffer native_code;
+
+	struct nanovm_profile *profile;				// NULL unless created with NANOVM_PROFILE
+
+	// Debug map from nanoasm -g, see nanovm_load_map()
+	char *source_name;							// Source file the program was assembled from
+	unsigned int *source_lines;					// Line of the instruction at each address, or 0
+
+	struct nanovm_trace *trace;					// NULL unless nanovm_trace_start() was called
+} NanoVM;
+
+NanoVM *nanovm_create(int options);
+int nanovm_load(NanoVM *vm, const unsigned char *image, size_t size);
+int nanovm_load_shared(NanoVM *vm, const unsigned char *image, size_t size);
+int nanovm_run(NanoVM *vm, unsigned long cycles);
+int nanovm_run_limited(NanoVM *vm, const struct nanovm_limits *limits);
+void nanovm_reset(NanoVM *vm);
+void nanovm_destroy(NanoVM *vm);
+void nanovm_set_input(NanoVM *vm, const char *text, size_t size);
+void nanovm_flush(NanoVM *vm);
+void nanovm_break(NanoVM *vm, int address);
+void nanovm_print_fault(NanoVM *vm, FILE *fp);
+void nanovm_profile_report(NanoVM *vm, FILE *fp);
+int nanovm_save(NanoVM *vm, FILE *fp);
+int nanovm_restore(NanoVM *vm, const unsigned char *snapshot, size_t size);
+int nanovm_load_map(NanoVM *vm, FILE *fp);
+void nanovm_print_source_line(NanoVM *vm, FILE *fp, unsigned short address);
+int nanovm_trace_start(NanoVM *vm, unsigned long records, FILE *fp);
+int nanovm_trace_write(NanoVM *vm, FILE *fp);
+void nanovm_trace_stop(NanoVM *vm);
+int nanovm_print_trace(FILE *in, FILE *out);
+const char *nanovm_dispatch_name();
+
+#endif
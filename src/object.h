@@ -0,0 +1,49 @@
+#ifndef object
+#define object
+
+/* object.h - The relocatable object file format written by nanoasm -c and read by nanold.
+ *
+ * An object file is a header, then the module's code assembled as if it were loaded at
+ * address 0, then its symbols, its relocations and the symbols' names. The numbers are in
+ * the host's byte order, like the image header. Nothing after the header is aligned, so a
+ * reader copies the records out of the file rather than pointing into it.
+ */
+
+#define NANOOBJ_MAGIC 0xd00e
+
+struct object_header {
+	unsigned short magic;
+	unsigned short reserved;
+	unsigned int code_size;
+	unsigned int num_symbols;
+	unsigned int num_relocations;
+	unsigned int names_size;
+};
+
+// Symbol types
+#define NANOOBJ_LABEL 0				// An address in the module, exported with GLOBAL
+#define NANOOBJ_CONSTANT 1			// An EQU, exported with GLOBAL
+#define NANOOBJ_EXTERN 2			// Used in the module but defined in another one
+
+struct object_symbol {
+	unsigned int name;				// Where its name starts in the names
+	unsigned short value;			// Address in the module, or the constant
+	unsigned short type;
+};
+
+// Relocation types
+#define NANOOBJ_WORD 0				// The operand is the address
+#define NANOOBJ_LOW 1				// The operand is its low byte (<)
+#define NANOOBJ_HIGH 2				// The operand is its high byte (>)
+
+#define NANOOBJ_MODULE -1			// Relative to the module's own load address, not a symbol
+
+struct object_relocation {
+	unsigned int offset;			// Where the operand is in the code
+	int symbol;						// Index into the symbols, or NANOOBJ_MODULE
+	unsigned short addend;			// Added to the symbol's address
+	unsigned char type;
+	unsigned char size;				// Bytes in the operand, 1 or 2, high byte first
+};
+
+#endif
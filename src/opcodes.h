@@ -63,4 +63,69 @@
 #define SEC			58	// Set carry flag
 #define JCS			59	// Jump if carry set
 #define JCC			60	// Jump if carry clear
+#define MEMCPY		61	// Copy a block of memory. The operand is the address of a parameter block, see below
+#define MEMSET		62	// Fill a block of memory with the low byte of the accumulator
+#define MEMCMP		63	// Compare two blocks of memory and set Z (and carry) appropriately
+
+/* The block instructions' parameter block is three big-endian words: the destination address,
+ * the source address and the length in bytes. MEMSET has no source and ignores that word.
+ */
+
+// Zero page: a one byte address, $00 to $ff
+#define LDA_ZP		64	// Load accumulator
+#define STA_ZP		65	// Store accumulator
+#define ADD_ZP		66	// Add to accumulator with carry
+#define SUB_ZP		67	// Subtract from accumulator with carry
+#define CMP_ZP		68	// Compare with accumulator and set Z flag appropriately
+#define AND_ZP		69	// AND accumulator
+#define OR_ZP		70	// OR accumulator
+#define XOR_ZP		71	// XOR accumulator
+#define LDX_ZP		72	// Load X register
+#define LDY_ZP		73	// Load Y register
+#define STX_ZP		74	// Store X register
+#define STY_ZP		75	// Store Y register
+
+// Absolute indexed: the operand plus X, or plus Y
+#define LDA_ABS_X	76	// Load accumulator
+#define STA_ABS_X	77	// Store accumulator
+#define ADD_ABS_X	78	// Add to accumulator with carry
+#define SUB_ABS_X	79	// Subtract from accumulator with carry
+#define CMP_ABS_X	80	// Compare with accumulator and set Z flag appropriately
+#define AND_ABS_X	81	// AND accumulator
+#define OR_ABS_X	82	// OR accumulator
+#define XOR_ABS_X	83	// XOR accumulator
+#define LDA_ABS_Y	84	// Load accumulator
+#define STA_ABS_Y	85	// Store accumulator
+#define ADD_ABS_Y	86	// Add to accumulator with carry
+#define SUB_ABS_Y	87	// Subtract from accumulator with carry
+#define CMP_ABS_Y	88	// Compare with accumulator and set Z flag appropriately
+#define AND_ABS_Y	89	// AND accumulator
+#define OR_ABS_Y	90	// OR accumulator
+#define XOR_ABS_Y	91	// XOR accumulator
+
+// Indirect indexed: the big-endian address held at the zero page operand and the byte after it, plus Y
+#define LDA_IND_Y	92	// Load accumulator
+#define STA_IND_Y	93	// Store accumulator
+#define ADD_IND_Y	94	// Add to accumulator with carry
+#define SUB_IND_Y	95	// Subtract from accumulator with carry
+#define CMP_IND_Y	96	// Compare with accumulator and set Z flag appropriately
+#define AND_IND_Y	97	// AND accumulator
+#define OR_IND_Y	98	// OR accumulator
+#define XOR_IND_Y	99	// XOR accumulator
+
+// Wide: all 16 bits of the accumulator, and words in memory stored low byte first. Z and the
+// carry reflect the whole word.
+#define LDAW_IMM	100	// Load accumulator with a 16 bit immediate value
+#define LDAW_ABS	101	// Load accumulator with the word at a memory address
+#define STAW		102	// Store accumulator to the word at a memory address
+#define ADDW_IMM	103	// Add a 16 bit immediate value and the carry to the accumulator
+#define ADDW_ABS	104	// Add the word at a memory address and the carry to the accumulator
+#define SUBW_IMM	105	// Subtract a 16 bit immediate value from the accumulator, with carry as not borrow
+#define SUBW_ABS	106	// Subtract the word at a memory address from the accumulator, with carry as not borrow
+#define CMPW_IMM	107	// Compare a 16 bit value with the accumulator. Z if equal, carry if the accumulator is higher or equal
+#define CMPW_ABS	108	// Compare the word at a memory address with the accumulator, setting Z and carry like CMPW_IMM
+#define INCW		109	// Increment the accumulator. Carry if it wraps to 0
+#define DECW		110	// Decrement the accumulator. Carry if it wraps to $ffff
+
+#define NUM_OPCODES	111	// Number of opcodes
 #endif
\ No newline at end of file
@@ -0,0 +1,1105 @@
+/* vm.c - The nanovm machine: instruction cache, superinstructions, JIT glue and the
+ * dispatch loop. Everything a program can change lives in its NanoVM, so any number of
+ * machines can run in one process.
+ *
+ * Author: Mario Gianota July 2021
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include "opcodes.h"
+#include "nanovm.h"
+
+/* Instruction dispatch.
+ *
+ * With GCC (and clang) the main loop is threaded: every handler ends by fetching the
+ * next opcode and jumping straight to its label through dispatch_table, so each
+ * instruction gets its own indirect branch instead of sharing the one at the top of
+ * a switch. Other compilers, or a build with -DSWITCH_DISPATCH, get the plain switch.
+ *
+ * BRANCH ends the handlers of instructions that jump. It also stops the loop once the
+ * cycles nanovm_run() was given are used up, so a program can only run past its budget
+ * by the straight-line code up to its next jump. Straight-line code that runs off the end
+ * of memory carries on at $0000, so the instruction at the end checks the budget too.
+ */
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#ifdef THREADED_DISPATCH
+#define DISPATCH()				d = &cache[pc]; goto *dispatch_table[d->op];
+#define HANDLER(op)				L_##op
+#define INSTRUCTION(op)			L_##op: COUNT(op) pc += SIZE(op);
+#define ILLEGAL_INSTRUCTION		illegal_instruction
+#define NEXT					total_cycles++; d = &cache[pc]; goto *dispatch_table[d->op]
+#define BRANCH					total_cycles++; if( total_cycles >= cycle_limit ) goto out_of_cycles; d = &cache[pc]; goto *dispatch_table[d->op]
+#define RETRY					d = &cache[pc]; goto *dispatch_table[d->op]
+#define DISPATCH_OP(op)			goto *dispatch_table[op]
+#define DISPATCH_NAME			"threaded"
+#else
+#define DISPATCH()				d = &cache[pc]; op = d->op; dispatch: switch(op)
+#define HANDLER(op)				case op
+#define INSTRUCTION(op)			case DECODED(op): COUNT(op) pc += SIZE(op);
+#define ILLEGAL_INSTRUCTION		default
+#define NEXT					total_cycles++; continue
+#define BRANCH					total_cycles++; if( total_cycles >= cycle_limit ) goto out_of_cycles; continue
+#define RETRY					continue
+#define DISPATCH_OP(next_op)	op = next_op; goto dispatch
+#define DISPATCH_NAME			"switch"
+#endif
+
+// Stop the loop with a fault. Handlers trap before they change anything, so pc goes back to the instruction.
+#define TRAP(code, op)			{ pc -= SIZE(op); vm->fault = code; status = NANOVM_FAULT; goto out_of_cycles; }
+
+/* Address of an (operand),Y access: the big-endian word at the zero page operand, plus Y.
+ * Indexing uses the low byte of X or Y, the byte their Z flag reflects, so INX and DEX loops
+ * cover 0 to 255 however the register wraps.
+ */
+#define INDIRECT_Y(zp)			((unsigned short) ((memory[zp] << 8 | memory[(zp) + 1]) + (y & 0xff)))
+
+// The word at address, for the wide instructions. Words in memory are stored low byte first.
+#define LOAD_WORD(address)		((unsigned short) (memory[address] | memory[(address) + 1] << 8))
+
+// Size in bytes of each opcode's operand. Opcodes not listed have no operand.
+#define SIZE(op) (1 + operand_size[op])					// Size of a whole instruction
+static const unsigned char operand_size[256] = {
+	[LDA_IMM] = 1, [ADD_IMM] = 1, [SUB_IMM] = 1, [MUL_IMM] = 1, [DIV_IMM] = 1, [CMP_IMM] = 1,
+	[LDX_IMM] = 1, [LDY_IMM] = 1, [CPX_IMM] = 1, [CPY_IMM] = 1, [AND_IMM] = 1, [OR_IMM] = 1,
+	[XOR_IMM] = 1,
+	[LDA_ABS] = 2, [STA] = 2, [ADD_ABS] = 2, [SUB_ABS] = 2, [MUL_ABS] = 2, [DIV_ABS] = 2,
+	[JMP] = 2, [JEQ] = 2, [JNE] = 2, [JSR] = 2, [CMP_ABS] = 2, [JMP_IND] = 2, [LDX_ABS] = 2,
+	[LDY_ABS] = 2, [STX] = 2, [STY] = 2, [CPX_ABS] = 2, [CPY_ABS] = 2, [AND_ABS] = 2,
+	[OR_ABS] = 2, [XOR_ABS] = 2, [JCS] = 2, [JCC] = 2, [MEMCPY] = 2, [MEMSET] = 2, [MEMCMP] = 2,
+	[LDA_ZP] = 1, [STA_ZP] = 1, [ADD_ZP] = 1, [SUB_ZP] = 1, [CMP_ZP] = 1, [AND_ZP] = 1,
+	[OR_ZP] = 1, [XOR_ZP] = 1, [LDX_ZP] = 1, [LDY_ZP] = 1, [STX_ZP] = 1, [STY_ZP] = 1,
+	[LDA_ABS_X] = 2, [STA_ABS_X] = 2, [ADD_ABS_X] = 2, [SUB_ABS_X] = 2, [CMP_ABS_X] = 2,
+	[AND_ABS_X] = 2, [OR_ABS_X] = 2, [XOR_ABS_X] = 2, [LDA_ABS_Y] = 2, [STA_ABS_Y] = 2,
+	[ADD_ABS_Y] = 2, [SUB_ABS_Y] = 2, [CMP_ABS_Y] = 2, [AND_ABS_Y] = 2, [OR_ABS_Y] = 2,
+	[XOR_ABS_Y] = 2, [LDA_IND_Y] = 1, [STA_IND_Y] = 1, [ADD_IND_Y] = 1, [SUB_IND_Y] = 1,
+	[CMP_IND_Y] = 1, [AND_IND_Y] = 1, [OR_IND_Y] = 1, [XOR_IND_Y] = 1,
+	[LDAW_IMM] = 2, [LDAW_ABS] = 2, [STAW] = 2, [ADDW_IMM] = 2, [ADDW_ABS] = 2, [SUBW_IMM] = 2,
+	[SUBW_ABS] = 2, [CMPW_IMM] = 2, [CMPW_ABS] = 2
+};
+
+/* How each opcode's operand is written, for listings. A one byte operand not listed is
+ * immediate and a two byte one absolute, so those modes are the operand sizes. The wide
+ * instructions' immediates are listed.
+ */
+#define MODE_IMMEDIATE 1
+#define MODE_ABSOLUTE 2
+#define MODE_INDIRECT 3
+#define MODE_ZERO_PAGE 4
+#define MODE_ABSOLUTE_X 5
+#define MODE_ABSOLUTE_Y 6
+#define MODE_INDIRECT_Y 7
+#define MODE(op) (operand_mode[op] != 0 ? operand_mode[op] : operand_size[op])
+static const unsigned char operand_mode[256] = {
+	[JMP_IND] = MODE_INDIRECT, [LDA_ZP] = MODE_ZERO_PAGE, [STA_ZP] = MODE_ZERO_PAGE,
+	[ADD_ZP] = MODE_ZERO_PAGE, [SUB_ZP] = MODE_ZERO_PAGE, [CMP_ZP] = MODE_ZERO_PAGE,
+	[AND_ZP] = MODE_ZERO_PAGE, [OR_ZP] = MODE_ZERO_PAGE, [XOR_ZP] = MODE_ZERO_PAGE,
+	[LDX_ZP] = MODE_ZERO_PAGE, [LDY_ZP] = MODE_ZERO_PAGE, [STX_ZP] = MODE_ZERO_PAGE,
+	[STY_ZP] = MODE_ZERO_PAGE, [LDA_ABS_X] = MODE_ABSOLUTE_X, [STA_ABS_X] = MODE_ABSOLUTE_X,
+	[ADD_ABS_X] = MODE_ABSOLUTE_X, [SUB_ABS_X] = MODE_ABSOLUTE_X,
+	[CMP_ABS_X] = MODE_ABSOLUTE_X, [AND_ABS_X] = MODE_ABSOLUTE_X, [OR_ABS_X] = MODE_ABSOLUTE_X,
+	[XOR_ABS_X] = MODE_ABSOLUTE_X, [LDA_ABS_Y] = MODE_ABSOLUTE_Y,
+	[STA_ABS_Y] = MODE_ABSOLUTE_Y, [ADD_ABS_Y] = MODE_ABSOLUTE_Y,
+	[SUB_ABS_Y] = MODE_ABSOLUTE_Y, [CMP_ABS_Y] = MODE_ABSOLUTE_Y,
+	[AND_ABS_Y] = MODE_ABSOLUTE_Y, [OR_ABS_Y] = MODE_ABSOLUTE_Y, [XOR_ABS_Y] = MODE_ABSOLUTE_Y,
+	[LDA_IND_Y] = MODE_INDIRECT_Y, [STA_IND_Y] = MODE_INDIRECT_Y,
+	[ADD_IND_Y] = MODE_INDIRECT_Y, [SUB_IND_Y] = MODE_INDIRECT_Y,
+	[CMP_IND_Y] = MODE_INDIRECT_Y, [AND_IND_Y] = MODE_INDIRECT_Y, [OR_IND_Y] = MODE_INDIRECT_Y,
+	[XOR_IND_Y] = MODE_INDIRECT_Y, [LDAW_IMM] = MODE_IMMEDIATE, [ADDW_IMM] = MODE_IMMEDIATE,
+	[SUBW_IMM] = MODE_IMMEDIATE, [CMPW_IMM] = MODE_IMMEDIATE
+};
+static const char *mode_format[] = { "", "#%d", "$%04x", "($%04x)", "$%02x", "$%04x,X", "$%04x,Y", "($%02x),Y" };
+static const char *mode_name[] = { "", "#", "$", "($)", "zp", "$,X", "$,Y", "(zp),Y" };
+
+// Assembler mnemonic of each opcode, for the profile report
+static const char *mnemonics[NUM_OPCODES] = {
+	[LDA_IMM] = "LDA", [LDA_ABS] = "LDA", [STA] = "STA", [ADD_IMM] = "ADD", [ADD_ABS] = "ADD",
+	[SUB_IMM] = "SUB", [SUB_ABS] = "SUB", [MUL_IMM] = "MUL", [MUL_ABS] = "MUL", [DIV_IMM] = "DIV",
+	[DIV_ABS] = "DIV", [JMP] = "JMP", [JEQ] = "JEQ", [JNE] = "JNE", [HALT] = "HALT", [IN] = "IN",
+	[OUT] = "OUT", [JSR] = "JSR", [RTS] = "RTS", [CMP_IMM] = "CMP", [CMP_ABS] = "CMP",
+	[JMP_IND] = "JMP", [PUSHA] = "PUSHA", [POPA] = "POPA", [SHL] = "SHL", [SHR] = "SHR",
+	[INC] = "INC", [DEC] = "DEC", [NOP] = "NOP", [LDX_IMM] = "LDX", [LDX_ABS] = "LDX",
+	[LDY_IMM] = "LDY", [LDY_ABS] = "LDY", [STX] = "STX", [STY] = "STY", [CPX_IMM] = "CPX",
+	[CPX_ABS] = "CPX", [CPY_IMM] = "CPY", [CPY_ABS] = "CPY", [TAX] = "TAX", [TAY] = "TAY",
+	[TXA] = "TXA", [TYA] = "TYA", [INX] = "INX", [INY] = "INY", [DEX] = "DEX", [DEY] = "DEY",
+	[NEG] = "NEG", [DUP] = "DUP", [SWAP] = "SWAP", [AND_IMM] = "AND", [AND_ABS] = "AND",
+	[OR_IMM] = "OR", [OR_ABS] = "OR", [XOR_IMM] = "XOR", [XOR_ABS] = "XOR", [NOT] = "NOT",
+	[CLC] = "CLC", [SEC] = "SEC", [JCS] = "JCS", [JCC] = "JCC", [MEMCPY] = "MEMCPY",
+	[MEMSET] = "MEMSET", [MEMCMP] = "MEMCMP",
+	[LDA_ZP] = "LDA", [STA_ZP] = "STA", [ADD_ZP] = "ADD", [SUB_ZP] = "SUB", [CMP_ZP] = "CMP",
+	[AND_ZP] = "AND", [OR_ZP] = "OR", [XOR_ZP] = "XOR", [LDX_ZP] = "LDX", [LDY_ZP] = "LDY",
+	[STX_ZP] = "STX", [STY_ZP] = "STY", [LDA_ABS_X] = "LDA", [STA_ABS_X] = "STA",
+	[ADD_ABS_X] = "ADD", [SUB_ABS_X] = "SUB", [CMP_ABS_X] = "CMP", [AND_ABS_X] = "AND",
+	[OR_ABS_X] = "OR", [XOR_ABS_X] = "XOR", [LDA_ABS_Y] = "LDA", [STA_ABS_Y] = "STA",
+	[ADD_ABS_Y] = "ADD", [SUB_ABS_Y] = "SUB", [CMP_ABS_Y] = "CMP", [AND_ABS_Y] = "AND",
+	[OR_ABS_Y] = "OR", [XOR_ABS_Y] = "XOR", [LDA_IND_Y] = "LDA", [STA_IND_Y] = "STA",
+	[ADD_IND_Y] = "ADD", [SUB_IND_Y] = "SUB", [CMP_IND_Y] = "CMP", [AND_IND_Y] = "AND",
+	[OR_IND_Y] = "OR", [XOR_IND_Y] = "XOR", [LDAW_IMM] = "LDAW", [LDAW_ABS] = "LDAW",
+	[STAW] = "STAW", [ADDW_IMM] = "ADDW", [ADDW_ABS] = "ADDW", [SUBW_IMM] = "SUBW",
+	[SUBW_ABS] = "SUBW", [CMPW_IMM] = "CMPW", [CMPW_ABS] = "CMPW", [INCW] = "INCW", [DECW] = "DECW"
+};
+
+const char *nanovm_dispatch_name() {
+	return DISPATCH_NAME;
+}
+
+// Fetch a big-endian 16 bit operand
+static unsigned short fetchUInt16(NanoVM *vm, unsigned short address) {
+	return vm->memory[address] << 8 | vm->memory[address + 1];
+}
+
+/* Count the executions of the entry at address, a branch target, so it is compiled once it
+ * is hot. If it still has a compiled block it runs that straight away.
+ */
+static void jit_count(NanoVM *vm, unsigned short address) {
+	struct decoded *d = &vm->decoded[address];
+
+	if( d->op == OP_JIT_COUNT || d->op == OP_JIT_ENTER || d->op == OP_BREAK )
+		return;
+	d->fuse = d->op == OP_FUSE_CANDIDATE ? DECODED(d->opcode) : d->op;
+	d->op = vm->jit_code[address] != NULL ? OP_JIT_ENTER : OP_JIT_COUNT;
+	d->hits = 0;
+}
+
+// Note a branch target. Entries not decoded yet start counting when they are.
+static void jit_target(NanoVM *vm, unsigned short address) {
+	vm->jit_flags[address] |= JIT_TARGET;
+	if( vm->decoded[address].op != OP_DECODE )
+		jit_count(vm, address);
+}
+
+// Compile the block at address. Returns 0 if it can't be compiled.
+static int compile_block(NanoVM *vm, unsigned short address) {
+	unsigned int end;
+	jit_block code;
+
+	if( vm->compiled_blocks == JIT_MAX_BLOCKS )
+		return 0;
+	code = jit_compile(&vm->native_code, vm->memory, address,
+		vm->break_address > address ? vm->break_address : 0x10000, &end);
+	if( code == NULL && vm->native_code.start == NULL ) {
+		// The code buffer is gone, and the blocks in it with it
+		for(int i=0; i<vm->compiled_blocks; i++) {
+			if( vm->jit_code[vm->jit_blocks[i].start] == vm->jit_blocks[i].code ) {
+				vm->jit_code[vm->jit_blocks[i].start] = NULL;
+				vm->decoded[vm->jit_blocks[i].start].op = OP_DECODE;
+			}
+		}
+		vm->compiled_blocks = 0;
+	}
+	if( code == NULL )
+		return 0;
+	vm->jit_code[address] = code;
+	vm->jit_blocks[vm->compiled_blocks].start = address;
+	vm->jit_blocks[vm->compiled_blocks].end = end;
+	vm->jit_blocks[vm->compiled_blocks].code = code;
+	vm->compiled_blocks++;
+	for(unsigned int i = address; i < end; i++)
+		vm->jit_flags[i] |= JIT_COVERED;
+
+	// The block may run past the instructions decoded so far. Stores into it still have to find it.
+	if( address < vm->code_lo )
+		vm->code_lo = address;
+	if( end > vm->code_hi )
+		vm->code_hi = end;
+	return 1;
+}
+
+// Drop the compiled blocks with an instruction at address
+static void jit_invalidate(NanoVM *vm, unsigned short address) {
+	for(int i=0; i<vm->compiled_blocks; i++) {
+		struct jit_range *b = &vm->jit_blocks[i];
+		if( address >= b->start && address < b->end && vm->jit_code[b->start] == b->code ) {
+			vm->jit_code[b->start] = NULL;
+			vm->decoded[b->start].op = OP_DECODE;
+		}
+	}
+}
+
+/* Decode the instruction at address into the instruction cache. Entries are decoded
+ * lazily the first time they are executed, so jumps into the middle of an instruction
+ * or into code written at run time decode like any other address.
+ */
+static void decode_instruction(NanoVM *vm, unsigned short address) {
+	struct decoded *d = &vm->decoded[address];
+	unsigned char opcode = vm->memory[address];
+	unsigned int next = address + 1 + operand_size[opcode];
+
+	// An instruction running off the end of memory is illegal too, see nanovm_print_fault().
+	// One that ends at the end of memory checks the budget first, as pc wraps round after it.
+	d->op = opcode < NUM_OPCODES && next <= MAX_MEM ? DECODED(opcode) : OP_ILLEGAL;
+	if( next == MAX_MEM && d->op != OP_ILLEGAL )
+		d->op = OP_WRAP;
+	d->opcode = opcode;
+	if( operand_size[opcode] == 1 )
+		d->operand = vm->memory[address + 1];
+	else if( operand_size[opcode] == 2 )
+		d->operand = fetchUInt16(vm, address + 1);
+	else
+		d->operand = 0;
+	d->next = next;
+
+	if( vm->jit_mode ) {
+		if( opcode == JMP || opcode == JEQ || opcode == JNE || opcode == JCS || opcode == JCC || opcode == JSR )
+			jit_target(vm, d->operand);
+		if( vm->jit_flags[address] & JIT_TARGET )
+			jit_count(vm, address);
+	}
+
+	// Track the decoded range so stores outside it skip invalidation
+	if( address < vm->code_lo )
+		vm->code_lo = address;
+	if( next > vm->code_hi )
+		vm->code_hi = next;
+}
+
+// Instruction sequences that have a superinstruction, longest first
+struct fusion {
+	unsigned char op;							// Superinstruction handler
+	unsigned char length;						// Number of instructions
+	unsigned char sequence[4];
+};
+
+static const struct fusion fusions[] = {
+	{ FUSED_LDA_SUB_STA_JNE, 4, { LDA_ABS, SUB_IMM, STA, JNE } },
+	{ FUSED_LDA_ADD_STA, 3, { LDA_ABS, ADD_ABS, STA } },
+	{ FUSED_LDA_STA, 2, { LDA_ABS, STA } },
+	{ FUSED_LDA_IMM_STA, 2, { LDA_IMM, STA } },
+	{ FUSED_CMP_JEQ, 2, { CMP_IMM, JEQ } },
+	{ FUSED_CMP_JNE, 2, { CMP_IMM, JNE } },
+	{ FUSED_SUB_JNE, 2, { SUB_IMM, JNE } },
+	{ FUSED_DEX_JNE, 2, { DEX, JNE } },
+	{ FUSED_DEY_JNE, 2, { DEY, JNE } }
+};
+
+static const int num_fusions = sizeof(fusions) / sizeof(fusions[0]);
+
+// Superinstructions find their instructions' entries at fixed offsets, so a sequence
+// may not wrap around the top of the address space, or end at it and skip OP_WRAP.
+static int matches(NanoVM *vm, const struct fusion *f, unsigned int address) {
+	for(int i=0; i<f->length; i++) {
+		if( address > 0xffff || vm->memory[address] != f->sequence[i] )
+			return 0;
+		if( i > 0 && address == vm->break_address )
+			return 0;
+		address += SIZE(f->sequence[i]);
+	}
+	return address < 0x10000;
+}
+
+/* Give the entry at address a superinstruction if the instructions starting there match
+ * one. The instructions after the first are decoded too, because the superinstruction
+ * reads their operands from their entries. A store into any of them also lands within
+ * MAX_FUSED_BYTES of address, so invalidation drops the superinstruction with them.
+ */
+static void fuse(NanoVM *vm, unsigned short address) {
+	struct decoded *d = &vm->decoded[address];
+
+	for(int i=0; i<num_fusions; i++) {
+		const struct fusion *f = &fusions[i];
+		if( ! matches(vm, f, address) )
+			continue;
+
+		unsigned short next = d->next;
+		for(int j=1; j<f->length; j++) {
+			if( vm->decoded[next].op == OP_DECODE )
+				decode_instruction(vm, next);
+			next = vm->decoded[next].next;
+		}
+
+		if( vm->fuse_mode == FUSE_PROFILE ) {
+			d->op = OP_FUSE_CANDIDATE;
+			d->fuse = f->op;
+			d->hits = 0;
+		} else {
+			d->op = f->op;
+			vm->fused_sites++;
+		}
+		return;
+	}
+}
+
+// Decode an instruction, and fuse it with the ones that follow it if they form a superinstruction
+static void decode(NanoVM *vm, unsigned short address) {
+	decode_instruction(vm, address);
+	if( address == vm->break_address ) {
+		vm->decoded[address].op = OP_BREAK;
+		return;
+	}
+	if( vm->fuse_mode != FUSE_OFF )
+		fuse(vm, address);
+	if( vm->jit_mode && vm->jit_flags[address] & JIT_TARGET )
+		jit_count(vm, address);			// Again, in case fuse() replaced the op
+}
+
+// Decode the program image from start up to end in one pass
+static void predecode(NanoVM *vm, unsigned short start, unsigned int end) {
+	unsigned int address = start;
+	while( address < end ) {
+		decode(vm, address);
+		address += 1 + operand_size[vm->memory[address]];
+	}
+}
+
+// Drop every cached instruction or superinstruction with a byte at address so it is decoded again
+static void invalidate(NanoVM *vm, unsigned short address) {
+	for(int i = address - (MAX_FUSED_BYTES - 1); i <= address; i++) {
+		if( i >= 0 )
+			vm->decoded[i].op = OP_DECODE;
+	}
+	if( vm->jit_mode && vm->jit_flags[address] & JIT_COVERED )
+		jit_invalidate(vm, address);
+}
+
+// Store a byte in memory. Stores into decoded code invalidate the cached instructions.
+static void store(NanoVM *vm, unsigned short address, unsigned char value) {
+	vm->memory[address] = value;
+	if( address >= vm->code_lo && address < vm->code_hi )
+		invalidate(vm, address);
+}
+
+// A block instruction's parameter block, see opcodes.h
+struct block {
+	unsigned int dest;
+	unsigned int source;
+	unsigned int length;
+};
+
+/* Read the parameter block at address. Returns 0 if it, or the destination (and the source,
+ * if the instruction has one), runs past the end of memory.
+ */
+static int read_block(NanoVM *vm, unsigned short address, struct block *b, int has_source) {
+	if( address > MAX_MEM - 6 )
+		return 0;
+	b->dest = fetchUInt16(vm, address);
+	b->source = fetchUInt16(vm, address + 2);
+	b->length = fetchUInt16(vm, address + 4);
+	return b->dest + b->length <= MAX_MEM && (! has_source || b->source + b->length <= MAX_MEM);
+}
+
+// After a block store. Only the part of it that overlaps decoded code needs invalidating.
+static void store_block(NanoVM *vm, struct block *b) {
+	unsigned int start = b->dest > vm->code_lo ? b->dest : vm->code_lo;
+	unsigned int end = b->dest + b->length < vm->code_hi ? b->dest + b->length : vm->code_hi;
+
+	for(unsigned int i = start; i < end; i++)
+		invalidate(vm, i);
+}
+
+/* Program I/O. OUT output collects in vm->output and goes to vm->out in one write when the
+ * buffer fills up, before IN waits for input from vm->in, before an error message and when
+ * nanovm_run() returns.
+ */
+void nanovm_flush(NanoVM *vm) {
+	if( vm->output_size > 0 )
+		fwrite(vm->output, 1, vm->output_size, vm->out);
+	vm->output_size = 0;
+}
+
+// Give IN a copy of all its input up front, instead of reading vm->in as it goes
+void nanovm_set_input(NanoVM *vm, const char *text, size_t size) {
+	free(vm->input);
+	vm->input = malloc(size + 1);
+	memcpy(vm->input, text, size);
+	vm->input[size] = 0;
+	vm->input_pos = vm->input;
+}
+
+// Read a number for IN the way scanf("%d") would. Returns 0 if there isn't one.
+static int read_number(NanoVM *vm, int *value) {
+	char *end;
+
+	if( vm->input == NULL ) {
+		nanovm_flush(vm);
+		fflush(vm->out);
+		return fscanf(vm->in, "%d", value) == 1;
+	}
+	*value = strtol(vm->input_pos, &end, 10);
+	if( end == vm->input_pos )
+		return 0;
+	vm->input_pos = end;
+	return 1;
+}
+
+// OUT prints acc as a decimal byte and a newline
+// Returns -1 without writing anything if the number would take the output past output_limit
+static int write_number(NanoVM *vm, unsigned char n) {
+	char *p;
+	int size = n >= 100 ? 4 : n >= 10 ? 3 : 2;
+
+	if( vm->output_limit > 0 && vm->output_bytes + size > vm->output_limit )
+		return -1;
+	vm->output_bytes += size;
+	if( vm->output_size > NANOVM_OUTPUT_BUFFER - 4 )
+		nanovm_flush(vm);
+	p = vm->output + vm->output_size;
+	if( n >= 100 )
+		*p++ = '0' + n / 100;
+	if( n >= 10 )
+		*p++ = '0' + n / 10 % 10;
+	*p++ = '0' + n % 10;
+	*p++ = '\n';
+	vm->output_size = p - vm->output;
+	return 0;
+}
+
+// The handlers check there is room with stack_room() and stack_holds() before they push or pop
+static void push(NanoVM *vm, unsigned char c) {
+	store(vm, --vm->stack_pointer, c);
+}
+
+static unsigned char pop(NanoVM *vm) {
+	return vm->memory[vm->stack_pointer++];
+}
+
+static int stack_room(NanoVM *vm, int bytes) {
+	return vm->stack_pointer >= bytes;
+}
+
+static int stack_holds(NanoVM *vm, int bytes) {
+	return vm->stack_pointer + bytes <= MAX_STACK - 1;
+}
+
+static unsigned char peek(NanoVM *vm) {
+	return vm->memory[vm->stack_pointer];
+}
+
+static char stack_is_empty(NanoVM *vm) {
+	return vm->stack_pointer == STACK_BOTTOM_ADDRESS;
+}
+
+/* Guest memory is an anonymous mapping of the whole address space. Pages the program never
+ * touches are never committed, so a small program costs a few pages however big memory is.
+ * An extra page past $ffff lets operand fetches that run off the end read zeros. Mapping
+ * over an existing block throws its pages away and puts fresh zero pages in their place.
+ * Returns NULL if it can't be mapped.
+ */
+static unsigned char *map_memory(unsigned char *memory) {
+	unsigned char *mapped = mmap(memory, MAX_MEM + MEM_PAGE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (memory != NULL ? MAP_FIXED : 0), -1, 0);
+	return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+// Zero memory, giving its pages back if it can
+static void clear_memory(NanoVM *vm) {
+	if( map_memory(vm->memory) == NULL )
+		memset(vm->memory, 0, MAX_MEM + MEM_PAGE);
+}
+
+// Returns NULL if there isn't the memory for it
+NanoVM *nanovm_create(int options) {
+	NanoVM *vm = calloc(1, sizeof(NanoVM));
+
+	if( vm == NULL )
+		return NULL;
+	vm->memory = map_memory(NULL);
+	vm->decoded = calloc(65536, sizeof(struct decoded));
+	vm->code_lo = 65536;
+	vm->break_address = -1;
+	vm->in = stdin;
+	vm->out = stdout;
+	vm->output = malloc(NANOVM_OUTPUT_BUFFER);
+	if( vm->memory == NULL || vm->decoded == NULL || vm->output == NULL )
+		goto failed;
+	if( options & NANOVM_PROFILE ) {
+		// Every instruction has to run on its own to be counted
+		vm->profile = calloc(1, sizeof(struct nanovm_profile));
+		if( vm->profile == NULL )
+			goto failed;
+		options = NANOVM_NO_FUSE;
+	}
+	if( options & NANOVM_NO_FUSE )
+		vm->fuse_mode = FUSE_OFF;
+	else if( options & NANOVM_FUSE_PROFILE )
+		vm->fuse_mode = FUSE_PROFILE;
+	else
+		vm->fuse_mode = FUSE_ALL;
+
+	// jit_mode stays 0 where there is no JIT compiler
+	if( options & NANOVM_JIT && jit_init(&vm->native_code) ) {
+		vm->jit_mode = 1;
+		vm->jit_flags = calloc(65536, 1);
+		vm->jit_code = calloc(65536, sizeof(jit_block));
+		vm->jit_blocks = malloc(JIT_MAX_BLOCKS * sizeof(struct jit_range));
+		if( vm->jit_flags == NULL || vm->jit_code == NULL || vm->jit_blocks == NULL )
+			goto failed;
+	}
+	return vm;
+
+failed:
+	nanovm_destroy(vm);
+	return NULL;
+}
+
+// Check a program image: the magic number $d00d and the load address, both little-endian, then the code
+static int check_image(const unsigned char *image, size_t size) {
+	if( size < 4 || (image[0] | image[1] << 8) != 0xd00d )
+		return NANOVM_BAD_MAGIC;
+	if( (image[2] | image[3] << 8) + size - 4 > MAX_MEM )
+		return NANOVM_TOO_LARGE;
+	return NANOVM_OK;
+}
+
+static void set_image(NanoVM *vm, const unsigned char *image, size_t size, int owned) {
+	if( vm->image_owned )
+		free((void *) (vm->image - 4));
+	vm->image = image + 4;
+	vm->image_size = size - 4;
+	vm->image_owned = owned;
+	vm->org = image[2] | image[3] << 8;
+	nanovm_reset(vm);
+}
+
+// Load a copy of a program image
+int nanovm_load(NanoVM *vm, const unsigned char *image, size_t size) {
+	int status = check_image(image, size);
+	if( status != NANOVM_OK )
+		return status;
+
+	unsigned char *copy = malloc(size);
+	memcpy(copy, image, size);
+	set_image(vm, copy, size, 1);
+	return NANOVM_OK;
+}
+
+/* Load a program image without copying it. The image has to stay where it is, unchanged,
+ * until the VM is destroyed or loads something else, so any number of VMs can run from one
+ * read-only mapping of an image file.
+ */
+int nanovm_load_shared(NanoVM *vm, const unsigned char *image, size_t size) {
+	int status = check_image(image, size);
+	if( status != NANOVM_OK )
+		return status;
+
+	set_image(vm, image, size, 0);
+	return NANOVM_OK;
+}
+
+// Forget every decoded instruction, superinstruction and compiled block
+static void clear_code(NanoVM *vm) {
+	// Only the range that was decoded needs clearing
+	if( vm->code_hi > vm->code_lo )
+		memset(&vm->decoded[vm->code_lo], 0, (vm->code_hi - vm->code_lo) * sizeof(struct decoded));
+	vm->code_lo = 65536;
+	vm->code_hi = 0;
+	vm->fused_sites = 0;
+
+	if( vm->jit_mode ) {
+		for(int i=0; i<vm->compiled_blocks; i++)
+			vm->jit_code[vm->jit_blocks[i].start] = NULL;
+		memset(vm->jit_flags, 0, 65536);
+		vm->compiled_blocks = 0;
+		jit_reset(&vm->native_code);
+	}
+}
+
+// Put the machine back the way nanovm_load() left it
+void nanovm_reset(NanoVM *vm) {
+	// Zero memory and copy the program image into it
+	clear_memory(vm);
+	memcpy(vm->memory + vm->org, vm->image, vm->image_size);
+
+	// Init stack. Bottom of stack is positioned by default at address $007f (decimal: 127)
+	vm->stack_pointer = STACK_BOTTOM_ADDRESS;
+
+	vm->pc = vm->org;
+	vm->acc = 0;
+	vm->x = 0;
+	vm->y = 0;
+	vm->z_flag = 0;
+	vm->carry_flag = 0;
+	vm->cycles = 0;
+	vm->halted = 0;
+	vm->fault = NANOVM_NO_FAULT;
+	vm->input_pos = vm->input;
+	vm->output_size = 0;
+	vm->output_bytes = 0;
+
+	clear_code(vm);
+	predecode(vm, vm->org, vm->org + vm->image_size);
+	if( vm->profile != NULL )
+		memset(vm->profile, 0, sizeof(struct nanovm_profile));
+}
+
+/* Make the next nanovm_run() stop when it gets to address, before running the instruction
+ * there, or -1 for no breakpoint. The breakpoint goes once it has been hit. Superinstructions
+ * and compiled blocks are built again so none of them runs past it.
+ */
+void nanovm_break(NanoVM *vm, int address) {
+	vm->break_address = address;
+	clear_code(vm);
+}
+
+// Write a snapshot of the machine. Returns 0, or -1 if it couldn't be written.
+int nanovm_save(NanoVM *vm, FILE *fp) {
+	static const unsigned char zeros[MEM_PAGE];
+	struct nanovm_snapshot header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = NANOVM_SNAPSHOT_MAGIC;
+	header.cycles = vm->cycles;
+	header.pc = vm->pc;
+	header.acc = vm->acc;
+	header.x = vm->x;
+	header.y = vm->y;
+	header.stack_pointer = vm->stack_pointer;
+	header.z_flag = vm->z_flag;
+	header.carry_flag = vm->carry_flag;
+	for(int page=0; page < MAX_MEM / MEM_PAGE; page++) {
+		if( memcmp(vm->memory + page * MEM_PAGE, zeros, MEM_PAGE) != 0 )
+			header.pages[header.num_pages++] = page;
+	}
+
+	if( fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(zeros, MEM_PAGE - sizeof(header), 1, fp) != 1 )
+		return -1;
+	for(int i=0; i<header.num_pages; i++) {
+		if( fwrite(vm->memory + header.pages[i] * MEM_PAGE, MEM_PAGE, 1, fp) != 1 )
+			return -1;
+	}
+	return fflush(fp) == 0 ? 0 : -1;
+}
+
+/* Carry on from a snapshot. Memory and registers come from the snapshot; the program image
+ * stays as it was, so nanovm_reset() still goes back to the start of the loaded program.
+ */
+int nanovm_restore(NanoVM *vm, const unsigned char *snapshot, size_t size) {
+	const struct nanovm_snapshot *header = (const struct nanovm_snapshot *) snapshot;
+
+	if( size < MEM_PAGE || header->magic != NANOVM_SNAPSHOT_MAGIC || header->num_pages > MAX_MEM / MEM_PAGE
+		|| size < (header->num_pages + 1) * (size_t) MEM_PAGE
+		|| header->stack_pointer < 0 || header->stack_pointer > STACK_BOTTOM_ADDRESS )
+		return NANOVM_BAD_SNAPSHOT;
+	for(int i=0; i<header->num_pages; i++)
+		if( header->pages[i] >= MAX_MEM / MEM_PAGE )
+			return NANOVM_BAD_SNAPSHOT;
+
+	clear_memory(vm);
+	for(int i=0; i<header->num_pages; i++)
+		memcpy(vm->memory + header->pages[i] * MEM_PAGE, snapshot + (i + 1) * MEM_PAGE, MEM_PAGE);
+
+	vm->stack_pointer = header->stack_pointer;
+	vm->pc = header->pc;
+	vm->acc = header->acc;
+	vm->x = header->x;
+	vm->y = header->y;
+	vm->z_flag = header->z_flag;
+	vm->carry_flag = header->carry_flag;
+	vm->cycles = header->cycles;
+	vm->halted = 0;
+	vm->fault = NANOVM_NO_FAULT;
+	vm->input_pos = vm->input;
+	vm->output_size = 0;
+	vm->output_bytes = 0;
+
+	clear_code(vm);
+	return NANOVM_OK;
+}
+
+/* Read a debug map written by nanoasm -g: a "source <file>" line, then a line with the address
+ * in hex and the source line number for every instruction. Returns 0, or -1 if it isn't a map.
+ */
+int nanovm_load_map(NanoVM *vm, FILE *fp) {
+	char name[1024];
+	unsigned int address;
+	int line;
+
+	if( fscanf(fp, "source %1023[^\n]\n", name) != 1 )
+		return -1;
+	free(vm->source_name);
+	vm->source_name = strdup(name);
+	if( vm->source_lines == NULL )
+		vm->source_lines = calloc(MAX_MEM, sizeof(unsigned int));
+	else
+		memset(vm->source_lines, 0, MAX_MEM * sizeof(unsigned int));
+	while( fscanf(fp, "%x %d\n", &address, &line) == 2 )
+		if( address < MAX_MEM && line > 0 )
+			vm->source_lines[address] = line;
+	return 0;
+}
+
+// Write " (file line n)" for the instruction at address, or nothing if the map doesn't have it
+void nanovm_print_source_line(NanoVM *vm, FILE *fp, unsigned short address) {
+	if( vm->source_lines != NULL && vm->source_lines[address] > 0 )
+		fprintf(fp, " (%s line %u)", vm->source_name, vm->source_lines[address]);
+}
+
+// Write what the fault that stopped the machine was, and where
+void nanovm_print_fault(NanoVM *vm, FILE *fp) {
+	switch( vm->fault ) {
+	case NANOVM_STACK_OVERFLOW:
+		fprintf(fp, "Error. Out of stack space. Stack size is: %d bytes. PC: $%x", MAX_STACK, vm->pc);
+		break;
+	case NANOVM_STACK_UNDERFLOW:
+		fprintf(fp, "Error. Stack underflow. PC: $%x", vm->pc);
+		break;
+	case NANOVM_DIVIDE_BY_ZERO:
+		fprintf(fp, "Error. Division by zero. PC: $%x", vm->pc);
+		break;
+	case NANOVM_ILLEGAL_INSTRUCTION:
+		fprintf(fp, "Error. Unhandled instruction code: %d Program Counter Address: $%x", vm->memory[vm->pc], vm->pc);
+		break;
+	case NANOVM_BAD_ADDRESS:
+		fprintf(fp, "Error. Address past the end of memory. PC: $%x", vm->pc);
+		break;
+	default:
+		return;
+	}
+	nanovm_print_source_line(vm, fp, vm->pc);
+	fprintf(fp, "\n");
+}
+
+// Write an instruction the way the assembler reads it
+static void print_instruction(NanoVM *vm, FILE *fp, unsigned short address) {
+	unsigned char opcode = vm->memory[address];
+
+	char operand[16];
+
+	if( opcode >= NUM_OPCODES ) {
+		fprintf(fp, "%-16s", "???");
+		return;
+	}
+	snprintf(operand, sizeof(operand), mode_format[MODE(opcode)],
+		operand_size[opcode] == 1 ? vm->memory[address + 1] : fetchUInt16(vm, address + 1));
+	fprintf(fp, "%-6s %-9s", mnemonics[opcode], operand);
+}
+
+struct hot_spot {
+	unsigned long count;
+	unsigned short address;
+};
+
+static int by_count(const void *a, const void *b) {
+	const struct hot_spot *x = a, *y = b;
+	if( x->count != y->count )
+		return x->count < y->count ? 1 : -1;
+	return x->address - y->address;
+}
+
+/* Write the profile of a VM created with NANOVM_PROFILE: executions of each opcode, then the
+ * PROFILE_HOT_SPOTS addresses that ran the most, with how often each conditional branch was taken.
+ */
+void nanovm_profile_report(NanoVM *vm, FILE *fp) {
+	struct nanovm_profile *profile = vm->profile;
+	struct hot_spot *spots = malloc(MAX_MEM * sizeof(struct hot_spot));
+	unsigned long total = 0;
+	int num_spots = 0;
+
+	unsigned long by_opcode[256];
+
+	// Code that was overwritten while it ran counts as whatever is there now
+	memset(by_opcode, 0, sizeof(by_opcode));
+	for(int address=0; address<MAX_MEM; address++) {
+		if( profile->executed[address] > 0 ) {
+			spots[num_spots].count = profile->executed[address];
+			spots[num_spots].address = address;
+			num_spots++;
+			by_opcode[vm->memory[address]] += profile->executed[address];
+			total += profile->executed[address];
+		}
+	}
+	if( total == 0 )
+		total = 1;
+
+	fprintf(fp, "Opcode               Count       %%\n");
+	for(int opcode=0; opcode<NUM_OPCODES; opcode++) {
+		if( by_opcode[opcode] == 0 )
+			continue;
+		fprintf(fp, "%-6s %-6s %12lu  %5.1f%%\n", mnemonics[opcode], mode_name[MODE(opcode)],
+			by_opcode[opcode], by_opcode[opcode] * 100.0 / total);
+	}
+
+	qsort(spots, num_spots, sizeof(struct hot_spot), by_count);
+
+	fprintf(fp, "\nAddress  Instruction               Count       %%       Taken   Not taken%s\n",
+		vm->source_lines != NULL ? "  Source" : "");
+	for(int i=0; i<num_spots && i<PROFILE_HOT_SPOTS; i++) {
+		unsigned short address = spots[i].address;
+		unsigned char opcode = vm->memory[address];
+		fprintf(fp, "$%04x    ", address);
+		print_instruction(vm, fp, address);
+		fprintf(fp, "%14lu  %5.1f%%", spots[i].count, spots[i].count * 100.0 / total);
+		if( opcode == JEQ || opcode == JNE || opcode == JCS || opcode == JCC )
+			fprintf(fp, "  %10lu  %10lu", profile->taken[address], spots[i].count - profile->taken[address]);
+		else if( vm->source_lines != NULL )
+			fprintf(fp, "  %10s  %10s", "", "");
+		nanovm_print_source_line(vm, fp, address);
+		fprintf(fp, "\n");
+	}
+	free(spots);
+}
+
+/* The writer thread. The VM hands records over TRACE_CHUNK at a time by moving published on,
+ * and waits when it gets a whole buffer ahead of written, so nothing is lost and neither side
+ * takes a lock.
+ */
+static void *trace_writer(void *arg) {
+	struct nanovm_trace *t = arg;
+	unsigned long written = t->written;
+
+	for(;;) {
+		int stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+		unsigned long published = __atomic_load_n(&t->published, __ATOMIC_ACQUIRE);
+		if( published == written ) {
+			if( stop )
+				break;
+			usleep(100);
+			continue;
+		}
+		while( written < published ) {
+			unsigned long start = written & (t->size - 1);
+			unsigned long n = published - written;
+			if( n > t->size - start )
+				n = t->size - start;
+			fwrite(&t->records[start], sizeof(struct nanovm_trace_record), n, t->fp);
+			written += n;
+		}
+		__atomic_store_n(&t->written, written, __ATOMIC_RELEASE);
+	}
+	fflush(t->fp);
+	return NULL;
+}
+
+// Hand a chunk of records to the writer thread, waiting for room for the next one
+static void trace_publish(struct nanovm_trace *t) {
+	__atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+	if( t->fp == NULL )
+		return;
+	while( t->head + TRACE_CHUNK - __atomic_load_n(&t->written, __ATOMIC_ACQUIRE) > t->size )
+		sched_yield();
+}
+
+static inline void trace_record(struct nanovm_trace_record *r, unsigned char opcode, unsigned short pc, unsigned short acc,
+		unsigned short x, unsigned short y, unsigned char z_flag, unsigned char carry_flag, signed short stack_pointer) {
+#ifdef __GNUC__
+	// Otherwise GCC packs the registers for the record once, before the dispatch jump, and then
+	// every handler shares that one jump and the branch predictor can't tell them apart
+	__asm__("" : "+r" (pc));
+#endif
+	r->pc = pc;
+	r->acc = acc;
+	r->x = x;
+	r->y = y;
+	r->stack_pointer = stack_pointer;
+	r->opcode = opcode;
+	r->flags = z_flag | carry_flag << 1;
+}
+
+static void write_trace_header(FILE *fp, unsigned long first_cycle) {
+	struct nanovm_trace_header header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = NANOVM_TRACE_MAGIC;
+	header.record_size = sizeof(struct nanovm_trace_record);
+	header.first_cycle = first_cycle;
+	fwrite(&header, sizeof(header), 1, fp);
+}
+
+/* Trace every instruction from now on. With fp, a thread writes every record to fp as the
+ * buffer fills; without, the buffer keeps the last records, at least the number asked for, for
+ * nanovm_trace_write(). Like profiling, tracing runs every instruction on its own, without
+ * superinstructions or the JIT until nanovm_trace_stop(). Returns 0, or -1 if the machine is
+ * being traced already or there isn't the memory for the buffer.
+ */
+int nanovm_trace_start(NanoVM *vm, unsigned long records, FILE *fp) {
+	if( vm->trace != NULL )
+		return -1;
+
+	struct nanovm_trace *t = calloc(1, sizeof(struct nanovm_trace));
+	if( t == NULL )
+		return -1;
+	t->size = TRACE_CHUNK;
+	while( t->size < records )
+		t->size *= 2;
+	t->records = malloc(t->size * sizeof(struct nanovm_trace_record));
+	if( t->records == NULL ) {
+		free(t);
+		return -1;
+	}
+	t->first_cycle = vm->cycles;
+	t->fp = fp;
+	if( fp != NULL ) {
+		write_trace_header(fp, t->first_cycle);
+		if( pthread_create(&t->writer, NULL, trace_writer, t) != 0 ) {
+			free(t->records);
+			free(t);
+			return -1;
+		}
+	}
+
+	vm->trace = t;
+	t->fuse_mode = vm->fuse_mode;
+	t->jit_mode = vm->jit_mode;
+	vm->fuse_mode = FUSE_OFF;
+	vm->jit_mode = 0;
+	clear_code(vm);
+	return 0;
+}
+
+// Write what the buffer holds, oldest first. Returns 0, or -1 if the VM isn't keeping a trace in memory.
+int nanovm_trace_write(NanoVM *vm, FILE *fp) {
+	struct nanovm_trace *t = vm->trace;
+	if( t == NULL || t->fp != NULL )
+		return -1;
+
+	unsigned long first = t->head > t->size ? t->head - t->size : 0;
+	write_trace_header(fp, t->first_cycle + first);
+	for(unsigned long i=first; i<t->head; i++)
+		fwrite(&t->records[i & (t->size - 1)], sizeof(struct nanovm_trace_record), 1, fp);
+	return 0;
+}
+
+/* Stop tracing. A streamed trace is written out to the end before the writer thread stops.
+ * Superinstructions and the JIT come back on if they were on before.
+ */
+void nanovm_trace_stop(NanoVM *vm) {
+	struct nanovm_trace *t = vm->trace;
+	if( t == NULL )
+		return;
+
+	if( t->fp != NULL ) {
+		__atomic_store_n(&t->published, t->head, __ATOMIC_RELEASE);
+		__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(t->writer, NULL);
+	}
+	vm->fuse_mode = t->fuse_mode;
+	vm->jit_mode = t->jit_mode;
+	free(t->records);
+	free(t);
+	vm->trace = NULL;
+	clear_code(vm);
+}
+
+// Write a trace file from nanovm_trace_start() or nanovm_trace_write() as text. Returns 0, or -1 if it isn't one.
+int nanovm_print_trace(FILE *in, FILE *out) {
+	struct nanovm_trace_header header;
+	struct nanovm_trace_record r;
+
+	if( fread(&header, sizeof(header), 1, in) != 1 || header.magic != NANOVM_TRACE_MAGIC
+			|| header.record_size != sizeof(struct nanovm_trace_record) )
+		return -1;
+
+	fprintf(out, "Cycle          Address  Opcode         ACC     X     Y  Z  C   SP\n");
+	for(unsigned long long cycle=header.first_cycle; fread(&r, sizeof(r), 1, in) == 1; cycle++) {
+		fprintf(out, "%-14llu $%04x    ", cycle, r.pc);
+		if( r.opcode < NUM_OPCODES )
+			fprintf(out, "%-6s %-6s", mnemonics[r.opcode], mode_name[MODE(r.opcode)]);
+		else
+			fprintf(out, "%-13d", r.opcode);
+		fprintf(out, " %5u %5u %5u  %d  %d  $%02x\n", r.acc, r.x, r.y, r.flags & 1, r.flags >> 1 & 1,
+			r.stack_pointer & 0xff);
+	}
+	return 0;
+}
+
+void nanovm_destroy(NanoVM *vm) {
+	nanovm_trace_stop(vm);
+	jit_free(&vm->native_code);
+	free(vm->jit_flags);
+	free(vm->jit_code);
+	free(vm->jit_blocks);
+	free(vm->decoded);
+	if( vm->image_owned )
+		free((void *) (vm->image - 4));
+	free(vm->input);
+	free(vm->output);
+	if( vm->memory != NULL )
+		munmap(vm->memory, MAX_MEM + MEM_PAGE);
+	free(vm->profile);
+	free(vm->source_name);
+	free(vm->source_lines);
+	free(vm);
+}
+
+/* The dispatch loop, compiled three times. COUNT(op) runs at the start of every instruction
+ * and COUNT_TAKEN() when a conditional branch is taken; only the profiling and tracing copies
+ * do anything in them. The profile counts by address alone, and the report adds the counts up
+ * by opcode.
+ */
+#define RUN_LOOP				run
+#define COUNT(op)
+#define COUNT_TAKEN()
+#include "dispatch.h"
+#undef RUN_LOOP
+#undef COUNT
+#undef COUNT_TAKEN
+
+#define RUN_LOOP				run_profiled
+#define PROFILING
+#define COUNT(op)				executed[pc]++;
+#define COUNT_TAKEN()			vm->profile->taken[pc - SIZE(JEQ)]++
+#include "dispatch.h"
+#undef RUN_LOOP
+#undef PROFILING
+#undef COUNT
+#undef COUNT_TAKEN
+
+#define RUN_LOOP				run_traced
+#define TRACING
+#define COUNT(op)				trace_record(&trace_records[trace_head++ & trace_mask], op, pc, acc, x, y, z_flag, carry_flag, vm->stack_pointer); \
+								trace->head = trace_head; \
+								if( (trace_head & (TRACE_CHUNK - 1)) == 0 ) \
+									trace_publish(trace);
+#define COUNT_TAKEN()
+#include "dispatch.h"
+
+/* Run the program for at least cycles instructions, or until it halts or hits the breakpoint.
+ * Returns NANOVM_HALTED, NANOVM_OUT_OF_CYCLES or NANOVM_BREAK. A machine that hasn't halted
+ * carries on where it stopped the next time it is run.
+ */
+int nanovm_run(NanoVM *vm, unsigned long cycles) {
+	if( vm->trace != NULL )
+		return run_traced(vm, cycles);
+	if( vm->profile != NULL )
+		return run_profiled(vm, cycles);
+	return run(vm, cycles);
+}
+
+static unsigned long micros() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+/* Run the program until it halts, hits the breakpoint or reaches one of the limits, for an
+ * image that might never halt. Returns NANOVM_HALTED, NANOVM_BREAK, NANOVM_CYCLE_LIMIT,
+ * NANOVM_TIME_LIMIT or NANOVM_OUTPUT_LIMIT, and the machine is left as it was when it stopped,
+ * so it can be looked at or run some more. The cycle and time limits are checked the way
+ * nanovm_run() checks its cycles, at jumps, branches, JSR and RTS, the time only once every
+ * NANOVM_SLICE cycles, so they can go over by a little. OUT stops the run before it writes
+ * anything past the output limit.
+ */
+int nanovm_run_limited(NanoVM *vm, const struct nanovm_limits *limits) {
+	unsigned long start = vm->cycles;
+	unsigned long deadline = limits->max_micros > 0 ? micros() + limits->max_micros : 0;
+	int status;
+
+	vm->output_limit = limits->max_output;
+	for(;;) {
+		unsigned long cycles = NANOVM_SLICE;
+		if( limits->max_cycles > 0 ) {
+			if( vm->cycles - start >= limits->max_cycles ) {
+				status = NANOVM_CYCLE_LIMIT;
+				break;
+			}
+			if( cycles > limits->max_cycles - (vm->cycles - start) )
+				cycles = limits->max_cycles - (vm->cycles - start);
+		}
+		status = nanovm_run(vm, cycles);
+		if( status != NANOVM_OUT_OF_CYCLES )
+			break;
+		if( deadline > 0 && micros() >= deadline ) {
+			status = NANOVM_TIME_LIMIT;
+			break;
+		}
+	}
+	vm->output_limit = 0;
+	return status;
+}
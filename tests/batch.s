@@ -0,0 +1,21 @@
+	ORG $200
+
+; batch.s - Counts down from its first input, then prints 100 divided by its second.
+; With no input the division faults.
+
+	IN
+	STA $300
+	IN
+	STA $301
+count:
+	LDA $300
+	JEQ divide
+	OUT
+	DEC
+	STA $300
+	JMP count
+divide:
+	LDA #100
+	DIV $301
+	OUT
+	HALT
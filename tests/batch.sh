@@ -0,0 +1,33 @@
+#!/bin/sh
+# batch.sh - --batch prints the same thing in the same order however many threads it has.
+#
+# The jobs take different times, so with four threads they finish out of order. The empty line
+# in the inputs is a job of its own, with no input.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+out=$(./nanoasm tests/batch.s $dir/batch.bin) || { echo "$out"; exit 1; }
+printf '3 5\n\n90 4\n0 7\n1\n40 2\n' > $dir/inputs.txt
+
+for threads in 1 4; do
+	./nanovm --batch --threads $threads --inputs $dir/inputs.txt $dir/batch.bin > $dir/all$threads.txt
+	echo $? > $dir/status$threads.txt
+	grep -v "^Ran \|per second" $dir/all$threads.txt > $dir/out$threads.txt
+done
+if ! cmp -s $dir/out1.txt $dir/out4.txt || ! cmp -s $dir/status1.txt $dir/status4.txt; then
+	echo "--threads 1 and --threads 4 differ"
+	diff $dir/out1.txt $dir/out4.txt
+	exit 1
+fi
+
+jobs=$(grep "^---" $dir/out1.txt | sed 's/.*input \([0-9]*\).*/\1/' | tr '\n' ' ')
+if [ "$jobs" != "1 2 3 4 5 6 " ]; then
+	echo "Jobs printed as '$jobs', expected '1 2 3 4 5 6 '"
+	exit 1
+fi
+if ! grep -A1 "input 2: .*stopped on an error" $dir/out1.txt | grep -q "Division by zero"; then
+	echo "The empty line didn't run as a job with no input"
+	cat $dir/out1.txt
+	exit 1
+fi
@@ -0,0 +1,39 @@
+#!/bin/sh
+# cache.sh - A cache hit says and writes what the miss before it did.
+#
+# The program starts at $80, which gets a warning, and has a load -O takes out, which gets a
+# report. It is assembled twice into an empty cache, then as a module, twice more.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+printf 'ORG $80\n\tLDA #1\n\tLDA #2\n\tOUT\n\tHALT\n' > $dir/prog.s
+printf '\tLDA #1\n\tLDA #2\n\tOUT\n\tRTS\n' > $dir/module.s
+
+./nanoasm -O --cache-dir $dir/cache $dir/prog.s $dir/miss.bin > $dir/miss.txt
+./nanoasm -O --cache-dir $dir/cache $dir/prog.s $dir/hit.bin > $dir/hit.txt
+if ! grep -q "^Warning" $dir/miss.txt || ! grep -q "Optimiser saved 2 bytes" $dir/miss.txt; then
+	echo "The miss didn't warn and report:"
+	cat $dir/miss.txt
+	exit 1
+fi
+if ! cmp -s $dir/miss.txt $dir/hit.txt || ! cmp -s $dir/miss.bin $dir/hit.bin; then
+	echo "The hit differs from the miss:"
+	diff $dir/miss.txt $dir/hit.txt
+	exit 1
+fi
+
+./nanoasm -O -c --cache-dir $dir/cache $dir/module.s > $dir/miss.txt
+cp $dir/module.o $dir/miss.o
+./nanoasm -O -c --cache-dir $dir/cache $dir/module.s > $dir/hit.txt
+if ! grep -q "Optimiser saved" $dir/miss.txt || ! cmp -s $dir/miss.txt $dir/hit.txt || ! cmp -s $dir/miss.o $dir/module.o; then
+	echo "The module's hit differs from its miss:"
+	diff $dir/miss.txt $dir/hit.txt
+	exit 1
+fi
+
+out=$(./nanoasm --cache-dir $dir/cache --cache-stats)
+if ! echo "$out" | grep -q ": 2 hits, 2 misses (50% hits), 2 entries,"; then
+	echo "Stats are '$out', expected 2 hits, 2 misses and 2 entries"
+	exit 1
+fi
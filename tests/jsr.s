@@ -0,0 +1,12 @@
+	ORG $120	; The return address's low byte is over $0f
+
+; jsr.s - JSR pushes the whole return address, so RTS comes back to the instruction after it.
+
+	JSR print2
+	LDA #1
+	OUT			; Prints 1, after print2's 2.
+	HALT
+print2:
+	LDA #2
+	OUT
+	RTS
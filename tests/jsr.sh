@@ -0,0 +1,14 @@
+#!/bin/sh
+# jsr.sh - A subroutine returns to the instruction after its JSR, wherever that is.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+out=$(./nanoasm tests/jsr.s $dir/jsr.bin) || { echo "$out"; exit 1; }
+for vm in ./nanovm "./nanovm --no-fuse" "./nanovm --jit"; do
+	out=$($vm --no-dump $dir/jsr.bin | sed -n '2,3p' | tr '\n' ' ')
+	if [ "$out" != "2 1 " ]; then
+		echo "$vm printed '$out', expected '2 1 '"
+		exit 1
+	fi
+done
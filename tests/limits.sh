@@ -0,0 +1,45 @@
+#!/bin/sh
+# limits.sh - --max-cycles and --max-time stop a program that never jumps.
+#
+# The image is two NOPs, and the rest of memory is zeros, LDA #0 over and over, so it runs
+# straight off the end of memory and round to $0000 for ever. Each run is given 5 seconds
+# before it counts as hung.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+printf '\015\320\000\001\034\034' > $dir/wrap.bin
+
+check() {
+	expected=$1
+	shift
+	out=$(timeout 5 "$@" $dir/wrap.bin)
+	status=$?
+	if [ $status -ne $expected ]; then
+		echo "$*: exit status $status, expected $expected"
+		echo "$out"
+		exit 1
+	fi
+}
+
+for vm in ./nanovm "./nanovm --no-fuse" "./nanovm --jit"; do
+	check 3 $vm --no-dump --max-cycles 1000
+	check 4 $vm --no-dump --max-time 0.5
+	check 3 $vm --no-dump --max-cycles 1000 --max-time 0.5
+done
+
+# Batch mode exits 1 if any job didn't halt, and says why for each one
+out=$(timeout 5 ./nanovm --batch --max-cycles 1000 $dir/wrap.bin $dir/wrap.bin)
+status=$?
+if [ $status -ne 1 ] || [ $(echo "$out" | grep -c "stopped at the cycle limit") -ne 2 ]; then
+	echo "--batch --max-cycles: exit status $status, expected 1 and two jobs at the cycle limit"
+	echo "$out"
+	exit 1
+fi
+out=$(timeout 5 ./nanovm --batch --max-time 0.5 $dir/wrap.bin)
+status=$?
+if [ $status -ne 1 ] || ! echo "$out" | grep -q "stopped at the time limit"; then
+	echo "--batch --max-time: exit status $status, expected 1 and the job at the time limit"
+	echo "$out"
+	exit 1
+fi
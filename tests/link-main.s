@@ -0,0 +1,17 @@
+; link-main.s - Linked with link-print.s by link.sh. Uses the other module's labels by address
+; (JSR print, LDX value) and by the bytes of an address (#<value, #>value), and its own by
+; address (JMP done). This module is an odd number of bytes long, so the records after the code in
+; its object file aren't aligned.
+
+	LDA #<value
+	OUT
+	LDA #>value
+	OUT
+	JSR print
+	LDX value
+	TXA
+	OUT
+	JMP done
+	HALT
+done:
+	HALT
@@ -0,0 +1,11 @@
+; link-print.s - The other module for link.sh.
+
+	GLOBAL print
+	GLOBAL value
+
+print:
+	LDA #42
+	OUT
+	RTS
+value:
+	NOP
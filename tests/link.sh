@@ -0,0 +1,18 @@
+#!/bin/sh
+# link.sh - nanold fixes up WORD, LOW and HIGH relocations, to other modules and its own.
+#
+# Linked at $1234, value is at $124b, so the program prints its low byte, 75, its high byte,
+# 18, then 42 from print, then 28, the NOP at value. JMP done skips a HALT, so it runs 13
+# instructions.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+cp tests/link-main.s tests/link-print.s $dir
+out=$(./nanoasm -c $dir/link-main.s $dir/link-print.s) || { echo "$out"; exit 1; }
+out=$(./nanold --org '$1234' $dir/link.bin $dir/link-main.o $dir/link-print.o) || { echo "$out"; exit 1; }
+out=$(./nanovm --no-dump $dir/link.bin | sed -n '2,6p' | sed 's/ Execution.*//' | tr '\n' ' ')
+if [ "$out" != "75 18 42 28 Number of cycles: 13. " ]; then
+	echo "Printed '$out', expected '75 18 42 28 Number of cycles: 13. '"
+	exit 1
+fi
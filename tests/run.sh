@@ -0,0 +1,19 @@
+#!/bin/sh
+# run.sh - The regression tests, run by make test.
+#
+# Each tests/*.sh is run from the top of the tree with the VM and assembler already built, and
+# passes if it exits with status 0. stdin is /dev/null, as --no-dump reads all of it up front.
+# A test that fails says why on its output.
+
+failed=0
+for test in tests/*.sh; do
+	[ "$test" = tests/run.sh ] && continue
+	if out=$(sh $test < /dev/null 2>&1); then
+		echo "PASS $test"
+	else
+		echo "FAIL $test"
+		echo "$out" | sed 's/^/	/'
+		failed=1
+	fi
+done
+exit $failed
@@ -0,0 +1,28 @@
+#!/bin/sh
+# snapshot.sh - --restore refuses a damaged snapshot rather than writing outside memory.
+#
+# A good snapshot is taken of examples/count.s, then copies of it are damaged: one with a page
+# index past the end of memory, and one with a stack pointer below the stack.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+./nanoasm examples/count.s $dir/count.bin > /dev/null || exit 1
+./nanovm --no-dump --snapshot-at 5 --snapshot-file $dir/good.snap $dir/count.bin > /dev/null
+./nanovm --no-dump --restore $dir/good.snap $dir/count.bin > /dev/null || { echo "Good snapshot not restored"; exit 1; }
+
+# The header is magic, num_pages, cycles, pc, acc, x, y, stack_pointer, z_flag, carry_flag, pages[]
+cp $dir/good.snap $dir/page.snap
+printf '\310' | dd of=$dir/page.snap bs=1 seek=28 conv=notrunc 2> /dev/null		# Page 200
+cp $dir/good.snap $dir/stack.snap
+printf '\000\001' | dd of=$dir/stack.snap bs=1 seek=24 conv=notrunc 2> /dev/null	# Stack pointer $100
+
+for snap in page stack; do
+	out=$(./nanovm --no-dump --restore $dir/$snap.snap $dir/count.bin)
+	status=$?
+	if [ $status -ne 1 ] || ! echo "$out" | grep -q "Not a nanovm snapshot file"; then
+		echo "$snap.snap: exit status $status, expected 1 and an error"
+		echo "$out"
+		exit 1
+	fi
+done